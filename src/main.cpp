@@ -20,9 +20,19 @@ Hardware resources
     - From megaTinyCore source code
         #define digitalPinHasPWM(p)
             ((p) == PIN_PA4 || (p) == PIN_PA5 || (p) == PIN_PB2 || (p) == PIN_PB1 || (p) == PIN_PB0 || (p) == PIN_PA3)
+    - The light outputs bypass analogWrite() and write their compare register directly (see padCompare[])
+    - A compare of 0 still drives the output for one count of each period (a glow of 1/255), so a pad at duty 0
+      is disconnected from its compare (CMPnEN bit cleared in TCA0.SPLIT.CTRLB) and held LOW by its port pin
+    - The prescaler of TCA0 is 8 instead of 64 for megaTinyCore: a PWM of 9.8 kHz at 20 MHz instead of 1.2 kHz,
+      free of stroboscopic effects and camera banding at low duties (see tools/flicker.py)
 - NmraDcc
     - Uses the INT0/1 Hardware Interrupt and micros() ONLY
     - On the attiny1616, millis() and micros() use TCD0
+    - The DCC input (PORTA port interrupt) stays at level 0 of CPUINT, with the millis() and UART interrupts.
+      It must not be raised to level 1 (CPUINT.LVL1VEC): the NmraDcc ISR reads the time of a DCC edge with
+      micros(), and preempting the TCD0 millis() ISR in the middle of its update would return a torn time.
+      Level 1 needs the edges timestamped by hardware (TCB input capture through the event system) in place of
+      micros(), which NmraDcc does not support. The latency at level 0 is measured with ISR_PROFILE
 
 - EEPROM
     - attiny 1616 EEPROM size is 256 bytes
@@ -30,13 +40,128 @@ Hardware resources
       (i.e., CV29 is stored at location 29)
     - We will also use location 255 to store the status of the functions (F0 to F4). The goal is to have the lights
       in the correct state at power on, before the decoder receives any DCC packet setting these functions
+    - After a firmware upgrade (EEPROM kept, CV7 older than versionId), the CVs added since the version in CV7 are
+      set to their factory default at boot (see upgradeCVs())
+    - Locations 150 to 153 hold the reset counters (read only CV150 to CV153). They saturate at 254, so that 0xFF
+      marks an erased counter (new chip or upgrade from a version without counters), started from 0 at boot
+    - Locations 154 to 207 hold the operating hours and energy of lights (see below)
+    - Locations 208 to 253 hold the flight recorder (see below)
+
+Operating hours and energy of lights
+- Every tick, the on-time and the duty of each light are added to fixed point accumulators
+- The totals are counted in units of 0.1 h: on-time, and energy as time at full duty (i.e. 0.1 h at 50% duty counts
+  for 0.05 h). They are saved every lightUsageSaveInterval ms when a light was on
+- The fractions of the units are saved with the totals in 1/16 of 0.1 h (22.5 s), and restored at boot to the middle
+  of their 1/16, so a power off loses nothing on average instead of up to 0.1 h per light
+- Wear leveling: the totals are saved alternately in two slots of 27 bytes (locations 154 and 181):
+  sequence number, totals of the five lights (2 x 2 bytes each, little endian), fractions of the five lights
+  (1 byte each: on-time in the low nibble, energy in the high nibble), checksum
+  At boot, the valid slot with the most recent sequence number is loaded
+
+Watchdog
+- The watchdog is enabled in window mode: it must be kicked between wdtClosedWindow and wdtClosedWindow + wdtOpenWindow
+  ms after the previous kick, otherwise the decoder resets
+- loop() kicks it every wdtKickInterval ms, only while the decoder is healthy (see isHealthy())
+
+Flight recorder
+- The last flightRecorderSize events (DCC packets for us, callbacks, CV changes, EEPROM writes) are kept in RAM
+  in a section which is not cleared by a reset
+- After a watchdog, brown-out or software reset, the events are saved to the EEPROM at the next boot
+    - Location 208: reset flags (RSTCTRL.RSTFR) of the reset which caused the save
+    - Location 209: number of events saved
+    - Locations 210 to 253: events, oldest first, 4 bytes each: time (2 bytes, little endian, in units of 16 ms),
+      event type (FlightRecorderEvent), event data
+- The flight recorder can be read as CV208 to CV253 or with tools/flightrec.py through the serial configuration port
+
+Serial configuration port (factory programming)
+- At power on, the decoder listens for serialConfigWindow ms on the swapped UART pins (TX on PA1, RX on PA2)
+  at 115200 baud. RX shares PA2 with the DCC input, so the programming jig drives it through the DCC input pads
+- The host sends the sync string "DCL" and the decoder answers 'S', versionId and the number of EEPROM pages
+  The host repeats the sync string every 10 ms until the answer, so the characters of the sync string received
+  during the session are ignored
+- Commands (each answered by 'K' on success or 'E' on error)
+    'W' + 256 bytes EEPROM image + CRC16 (little endian): write the complete EEPROM (CVs stored at the location
+        corresponding to the CV number, plus the other areas described above). The image is received and checked
+        first, then committed page by page (one '.' per page)
+    'R': answered by the 256 bytes EEPROM image + CRC16
+    'X': leave the configuration session and start the decoder
+- CRC16 is CRC-16/CCITT-FALSE (polynomial 0x1021, initial value 0xFFFF)
+- See tools/cvupload.py for the host uploader
+
+Interrupt profiling (ISR_PROFILE)
+- The DCC edge interrupt of NmraDcc, the millis() interrupt (TCD0) and the UART interrupts of megaTinyCore compete
+  for the CPU. Their ISRs are in the libraries, so they are measured from two interrupts of our own at level 0:
+    - TCB0 counts at CLK_PER / 2 (0.1 us at 20 MHz) and captures its counter on the rising edge of the DCC input
+      (the edge of the NmraDcc interrupt) through the event system. Its capture interrupt is at level 0 and its
+      vector comes after the one of PORTA, so it runs right after the NmraDcc ISR of the same edge: it measures
+      the time from the DCC edge to the end of the NmraDcc ISR (latency + duration)
+    - TCB1 raises a probe interrupt every isrProbePeriod clocks and reads its counter at the ISR entry: it measures
+      the latency of a level 0 interrupt, i.e. the time spent in the ISRs (or with interrupts disabled) running when
+      it is raised. The period is prime, so the probe drifts over the other interrupts
+- Both times are counted in histograms of isrHistogramBins bins, doubling from 3.2 us: < 3.2, < 6.4, < 12.8,
+  < 25.6, < 51.2 and >= 51.2 us (NmraDcc must read the time of a DCC edge well within a half bit of 58 us)
+- The counts (16 bits) are halved together when one of them saturates, so the shape of the histograms is kept
+- The histograms are readable as CV174 to CV197 (in place of the raw light usage slots), cleared at power on
+- Costs TCB0, TCB1 and two short ISRs per DCC edge and per probe: leave ISR_PROFILE undefined in production
+
+Host simulation
+- test/test_host builds this file for the host against stubs of megaTinyCore and NmraDcc, with a simulated time
+  base, and runs the tests of the decoder behaviour: pio test -e native (see test/test_host/hostsim.h)
 
 CV Map
 CV1     Primary Address
 CV7     Manufacturer Version Number
 CV8     Manufacturer ID Number
+CV15    Decoder Lock: key written by the user (always writable)
+CV16    Decoder Lock ID (1..7) of this decoder. 0 = Lock disabled
+        When CV15 differs from a non zero CV16, all CV writes but CV15 are rejected (and the CV8 reset ignored)
+CV17    Extended Address MSB
+CV18    Extended Address LSB
 CV29    Mode Control
 
+CV30    Day/night mode
+            0: Disabled (day brightness only)
+            1: Night from the model time broadcast by the command station
+            2: Night from a binary state (see CV33)
+CV31    Night start hour (0..23) for CV30 = 1
+CV32    Day start hour (0..23) for CV30 = 1
+CV33    Binary state number (1..255) selecting night for CV30 = 2
+CV34    Emergency stop reaction, on a broadcast stop or an emergency stop, until the loco is driven again
+            0: None
+            1: Hazard flash
+            2: On (e.g. rear red light)
+            3: Off (e.g. headlights)
+CV35    Lights affected by the emergency stop reaction (bit 0 = Light0 ... bit 4 = Light4)
+CV36    Binary state number (1..255) synchronizing the effects of all decoders when turned on. 0 = None
+CV37    Function number (0..28) synchronizing the effects of all decoders when turned on by a broadcast
+        function packet. 31 = None. A function above F4 avoids changing the lights of the decoders
+CV38    Interval (in s) at which the command station sends the effect synchronization (1..255). 0 = Unknown
+        When known, the drift of the decoder clock is measured and corrected between synchronizations
+CV39    Power budget: maximum total duty of all lights, in 1/255 of all lights at full duty. 255 = No limit
+        Above the budget, the lights are dimmed proportionally, normal priority lights first (see CV57)
+CV40    Tuning mode light: light number + 1 (1..5) whose brightness is tuned with the throttle. 0 = None
+CV41    Tuning mode function (0..28). 31 = None
+        Turning the function on enters the tuning mode: the speed knob sets the brightness of the light live.
+        Turning it off leaves the tuning mode and writes the brightness to CV50 (or CV55 at night) of the light
+        The brightness tuned is the value of the CV, before the analog level of CV104 scales it
+        A light using the brightness of a stock profile (CV58 = 1..127) cannot be tuned: the function is ignored
+CV42    Second address LSB
+CV43    Second address MSB. The decoder also listens to this address (1..10239). 0 = None (CV42 and CV43 = 0)
+        Lights can follow the speed, direction and functions F0 to F4 of this address instead of ours (see CV59)
+CV44    Power up stagger (in 0.1 s). At power on, the lights are restored after a delay between 0 and this
+        value, derived from the serial number of the chip and the address, so that all the decoders of the
+        layout do not load the booster at the same time. 0 = No delay (default)
+CV45    Power up ramp (in 0.1 s). After the power up delay, the lights ramp up to their duty in this time.
+        0 = No ramp (default). The lights are restored at most CV44 + CV45 after power on. See tools/inrush.py
+        to choose the values for a layout (e.g. CV44 = 10, CV45 = 5 for 40 decoders)
+        The stagger and the ramp apply to power on resets only (RSTCTRL.RSTFR.PORF): the lights of a decoder
+        reset alone (watchdog, brown-out, software reset) come back at once. They are skipped at the first
+        power on of a new decoder, whose CVs are not set yet
+CV46    Confirmation count N (1..8). A change of speed, direction or functions F0 to F4 is accepted only once it
+        has been received in N of the last M packets for the address (corrupted packets passing the checksum
+        no longer flash the lights on noisy track). 1 = Every packet is accepted. Emergency stops are never delayed
+CV47    Confirmation window M (N..8), in packets. See tools/confirmsim.py to choose N and M from a capture
+
 CV50    Light0 Brightness (0..255)
 CV51    Light0 Control Function (0..28). 31 = None (always on).
 CV52    Light0 Direction sensitivity
@@ -50,47 +175,230 @@ CV54    Light0 Effect
             0: No effect (always on)
             1: Strobe flash
             2: Rotating flash
+CV55    Light0 Night brightness (0..255), used instead of CV50 at night
+CV56    Light0 Binary state (1..255). 0 = None. When set, the light is on only when this binary state is on
+CV57    Light0 Power priority
+            0: Normal, dimmed first when the power budget (CV39) is exceeded
+            1: Protected (e.g. headlights), dimmed only if the protected lights alone exceed the power budget
+CV58    Light0 Profile
+            0: The light uses its own CVs (CV50 to CV57)
+            1..: The light uses the stock profile lightProfiles[CV58 - 1] in flash instead of CV50 to CV57
+            +128: The light keeps its own brightness (CV50 and CV55) and takes the rest from the profile
+                  (e.g. 129: headlight profile with the brightness of the light)
+CV59    Light0 Address
+            0: The light follows the speed, direction and functions of our address
+            1: The light follows the speed, direction and functions of the second address (CV42, CV43)
+
+CV60-69   Light1
+CV70-79   Light2
+CV80-89   Light3
+CV90-99   Light4
 
-CV60-64   Light1
-CV70-74   Light2
-CV80-84   Light3
-CV90-94   Light4
+CV100   Light0 On delay (in 0.2 s). The light turns on only after its conditions (function, direction, speed,
+        binary state) have been met for this time. 0 = No delay
+CV101   Light0 Off delay (in 0.2 s). The light stays on for this time after its conditions are no longer met
+        (e.g. cab light turned off 30 s after stopping). 0 = No delay
+CV102   Light0 One-shot duration (in 0.2 s). The light turns on for this time when its conditions become met,
+        whether they stay met or not (e.g. ditch lights flashing for 15 s after F2). 0 = No one-shot
+CV103   Light0 One-shot mode
+            0: Not retriggerable, the conditions becoming met again during the duration are ignored
+            1: Retriggerable, the conditions becoming met again restart the duration
+CV104   Light0 Analog channel (1..255) of the analog function group packets controlling the light. 0 = None
+        The packets of the address of the light (see CV59) and the broadcast packets are used. The value
+        received is kept in RAM only (no EEPROM write) and is full brightness / nominal rate at power on
+CV105   Light0 Analog mode
+            0: Brightness, the analog value (0..255) scales the brightness of the light (255 = CV50 or CV55)
+            1: Effect rate, the analog value sets the rate of the effect of the light in 1/64 of the
+               nominal rate (64 = nominal, 128 = twice as fast, 0 = frozen)
+CV106   Light0 Kick time (in 10 ms). When the light turns on, the output is driven at full duty for this time
+        (e.g. uncoupler coil pulling in). 0 = No kick
+CV107   Light0 Hold duty (0..255, not gamma corrected). After the kick, the duty of the output is limited to
+        this value (e.g. coil holding, smoke unit). 255 = No limit
+CV108   Light0 Maximum on-time (in s). The output is cut after being held (after the kick) for this time,
+        until the light turns off and on again. 0 = No limit
+        When CV106 or CV108 is set, the output is driven only while the light is on: the emergency stop reaction
+        of CV34 does not turn it on
+CV109   Light0 Output: light pad of the PCB (0..4) driven by the light, to fix a wiring mistake or adapt to a
+        harness without reflashing. Default: pad 0 for Light0 ... pad 4 for Light4. An invalid value selects the
+        default. When several lights drive the same pad, the highest light number wins
+
+CV110-119 Light1
+CV120-129 Light2
+CV130-139 Light3
+CV140-149 Light4
+
+CV150   Number of watchdog resets (read only, 0..254)
+CV151   Number of brown-out resets (read only, 0..254)
+CV152   Number of power on resets (read only, 0..254)
+CV153   Number of software resets (read only, 0..254)
+CV154-173 Operating hours and energy of lights (read only), 4 CVs per light (CV154-157 for Light0 ...):
+          on-time LSB, on-time MSB, energy LSB, energy MSB, in units of 0.1 h
+CV174-197 With ISR_PROFILE only: interrupt histograms (read only), 2 CVs per bin (count LSB, count MSB)
+          CV174-185: DCC edge to end of the NmraDcc ISR, CV186-197: probe interrupt latency
+CV208-253 Flight recorder (read only)
 \*************************************************************************************************************/
 
 #include <Arduino.h>
 #include <NmraDcc.h>
 #include <EEPROM.h>
+#include <avr/wdt.h>
 
 // Uncomment to send debugging messages to the serial line
 // #define DEBUG
 
+// Comment out to remove the serial configuration port used for factory programming
+#define SERIAL_CONFIG
+
+// Uncomment to measure the interrupt latency and duration (see the description at the top of this file)
+// #define ISR_PROFILE
+
 // Versioning
 const uint8_t versionIdMajor = 1;
-const uint8_t versionIdMinor = 3;
+const uint8_t versionIdMinor = 4;
 const uint8_t versionId = versionIdMajor << 4 | versionIdMinor;
 
 // Hardware pin definitions
 const uint8_t numberOfLights = 5;
 const pin_size_t pinLight[numberOfLights] = {PIN_PB1, PIN_PB0, PIN_PA5, PIN_PB2, PIN_PA4};
 //                      Light # on the PCB      0        1        2        3        4
+// TCA0 (split mode) compare register of each light pad, in the same order: WO0 to WO2 are the low
+// compares LCMP0 to LCMP2, WO3 to WO5 the high compares HCMP0 to HCMP2
+register8_t *const padCompare[numberOfLights] = {&TCA0.SPLIT.LCMP1, &TCA0.SPLIT.LCMP0, &TCA0.SPLIT.HCMP2, &TCA0.SPLIT.LCMP2, &TCA0.SPLIT.HCMP1};
+// Bit of TCA0.SPLIT.CTRLB connecting each light pad to its compare, in the same order
+const uint8_t padCompareEnableBit[numberOfLights] = {TCA_SPLIT_LCMP1EN_bm, TCA_SPLIT_LCMP0EN_bm, TCA_SPLIT_HCMP2EN_bm, TCA_SPLIT_LCMP2EN_bm, TCA_SPLIT_HCMP1EN_bm};
+const uint8_t padCompareEnable = TCA_SPLIT_LCMP0EN_bm | TCA_SPLIT_LCMP1EN_bm | TCA_SPLIT_LCMP2EN_bm | TCA_SPLIT_HCMP1EN_bm | TCA_SPLIT_HCMP2EN_bm;
 const pin_size_t pinDCCInput = PIN_PA2;
 const pin_size_t pinACKOutput = PIN_PA3;
 
-// lightCache[] stores the state (ON/OFF) of lights
-bool lightCache[numberOfLights];
-
 // Objects from NmraDcc
 NmraDcc Dcc;
 
-// Current value of loco speed, direction and speed steps
-uint8_t currentSpeed = 0;
-DCC_DIRECTION currentDirection = DCC_DIR_FWD;       // Either DCC_DIR_FWD or DCC_DIR_REV
-DCC_SPEED_STEPS currentSpeedSteps = SPEED_STEP_128; // Either SPEED_STEP_28 or SPEED_STEP_128
-uint8_t currentFuncState = 0;
+// The decoder listens to two addresses: our address (index 0) and the second address (index 1, CV42 and CV43)
+const uint8_t numberOfAddresses = 2;
+
+// Hot flags, tested by the light loop and the DCC callbacks, are kept in the general purpose I/O registers
+// A bit of these registers is tested by sbis/sbic and set or cleared by sbi/cbi in a single instruction, and in/out
+// access them in one cycle (lds/sts take two or three cycles and twice the flash). GPIOR0 is left to the core
+// avr-gcc emits these instructions only when the register and the bit are constants: a runtime index such as
+// (&GPIOR2)[addrIdx] or a runtime mask such as 1 << lightNr costs a load, a shift loop and a store. The flags are
+// therefore reached only through the functions below, which switch on the light or the address so that every
+// access names its register and its bit. See tools/gpiorcheck.py to check the listing of a build
+// LIGHT_FLAGS: bit n is set when Light n is on
+// OUR_ADDRESS_FLAGS, SECOND_ADDRESS_FLAGS: functions F0 to F4 (bit n = Fn), forward and moving of the loco at our
+// address and at the second address
+#define LIGHT_FLAGS GPIOR1
+#define OUR_ADDRESS_FLAGS GPIOR2
+#define SECOND_ADDRESS_FLAGS GPIOR3
+const uint8_t flagForward = 0x20;
+const uint8_t flagMoving = 0x40; // Speed is not zero
+const uint8_t flagsFunctions = 0x1F;
+
+inline bool isLightOn(uint8_t lightNr)
+{
+    switch (lightNr)
+    {
+    case 0:
+        return (LIGHT_FLAGS & 0x01);
+    case 1:
+        return (LIGHT_FLAGS & 0x02);
+    case 2:
+        return (LIGHT_FLAGS & 0x04);
+    case 3:
+        return (LIGHT_FLAGS & 0x08);
+    default:
+        return (LIGHT_FLAGS & 0x10);
+    }
+}
+
+inline void setLightOn(uint8_t lightNr, bool on)
+{
+    switch (lightNr)
+    {
+    case 0:
+        if (on)
+            LIGHT_FLAGS |= 0x01;
+        else
+            LIGHT_FLAGS &= ~0x01;
+        break;
+    case 1:
+        if (on)
+            LIGHT_FLAGS |= 0x02;
+        else
+            LIGHT_FLAGS &= ~0x02;
+        break;
+    case 2:
+        if (on)
+            LIGHT_FLAGS |= 0x04;
+        else
+            LIGHT_FLAGS &= ~0x04;
+        break;
+    case 3:
+        if (on)
+            LIGHT_FLAGS |= 0x08;
+        else
+            LIGHT_FLAGS &= ~0x08;
+        break;
+    default:
+        if (on)
+            LIGHT_FLAGS |= 0x10;
+        else
+            LIGHT_FLAGS &= ~0x10;
+        break;
+    }
+}
+
+// All the flags of the loco at an address (one in)
+inline uint8_t getAddressFlags(uint8_t addrIdx)
+{
+    return ((addrIdx == 0) ? OUR_ADDRESS_FLAGS : SECOND_ADDRESS_FLAGS);
+}
+
+// Test, set or clear flagForward or flagMoving (flag must be a constant) of the loco at an address
+inline bool testAddressFlag(uint8_t addrIdx, uint8_t flag)
+{
+    return ((addrIdx == 0) ? (OUR_ADDRESS_FLAGS & flag) : (SECOND_ADDRESS_FLAGS & flag));
+}
+
+inline void setAddressFlag(uint8_t addrIdx, uint8_t flag, bool value)
+{
+    if (addrIdx == 0)
+    {
+        if (value)
+            OUR_ADDRESS_FLAGS |= flag;
+        else
+            OUR_ADDRESS_FLAGS &= ~flag;
+    }
+    else
+    {
+        if (value)
+            SECOND_ADDRESS_FLAGS |= flag;
+        else
+            SECOND_ADDRESS_FLAGS &= ~flag;
+    }
+}
+
+// Store the state of functions F0 to F4 of an address, F0 (FN_BIT_00) moving from bit 4 to bit 0
+inline void setAddressFunctions(uint8_t addrIdx, uint8_t FuncState)
+{
+    uint8_t functions = (FuncState & 0x0F) << 1 | ((FuncState & FN_BIT_00) ? 1 : 0);
+    if (addrIdx == 0)
+        OUR_ADDRESS_FLAGS = (OUR_ADDRESS_FLAGS & ~flagsFunctions) | functions;
+    else
+        SECOND_ADDRESS_FLAGS = (SECOND_ADDRESS_FLAGS & ~flagsFunctions) | functions;
+}
+
+// Rest of the state of the loco at each address, grouped so that the callbacks reach all of it
+// from one pointer (ldd/std with displacement) instead of one absolute address per field
+struct LocoState
+{
+    uint8_t speed;
+    uint8_t speedSteps; // Either SPEED_STEP_28 or SPEED_STEP_128
+    uint8_t funcState;  // FuncState of the last FN_0_4 packet
+};
+LocoState locoState[numberOfAddresses] = {{0, SPEED_STEP_128, 0}, {0, SPEED_STEP_128, 0}};
 
-// fctsCache[] holds the current state (ON/OFF) of functions F0 to F4
-const uint8_t numberOfFctsInCache = 5;
-bool fctsCache[numberOfFctsInCache];
+// Functions F0 to F4 are used. Only the functions of our address are saved in the EEPROM
+const uint8_t numberOfFcts = 5;
 const uint16_t fctsEepromAddress = 255;
 
 // CV number definitions
@@ -98,7 +406,29 @@ const uint8_t CV0Check = 0;
 const uint8_t CV1PrimaryAddress = 1;
 const uint8_t CV7ManufacturerVersionNumber = 7;
 const uint8_t CV8ManufacturerIDNumber = 8;
+const uint8_t CV15DecoderLock = 15;
+const uint8_t CV16DecoderLockId = 16;
+const uint8_t CV17ExtendedAddressMSB = 17;
+const uint8_t CV18ExtendedAddressLSB = 18;
 const uint8_t CV29ModeControl = 29;
+const uint8_t CV30DayNightMode = 30;
+const uint8_t CV31NightStartHour = 31;
+const uint8_t CV32DayStartHour = 32;
+const uint8_t CV33NightBinaryState = 33;
+const uint8_t CV34EmergencyStopReaction = 34;
+const uint8_t CV35EmergencyStopLights = 35;
+const uint8_t CV36EffectSyncBinaryState = 36;
+const uint8_t CV37EffectSyncFunction = 37;
+const uint8_t CV38EffectSyncPeriod = 38;
+const uint8_t CV39PowerBudget = 39;
+const uint8_t CV40TuningLight = 40;
+const uint8_t CV41TuningFunction = 41;
+const uint8_t CV42SecondAddressLSB = 42;
+const uint8_t CV43SecondAddressMSB = 43;
+const uint8_t CV44PowerUpDelay = 44;
+const uint8_t CV45PowerUpRamp = 45;
+const uint8_t CV46ConfirmCount = 46;
+const uint8_t CV47ConfirmWindow = 47;
 
 // CVs related to light outputs. Each set is offset by 10
 const uint8_t CV50Light0Brightness = 50;
@@ -106,39 +436,115 @@ const uint8_t CV51Light0ControlFunction = 51;
 const uint8_t CV52Light0DirectionSensitivity = 52;
 const uint8_t CV53Light0SpeedSensitivity = 53;
 const uint8_t CV54Light0Effect = 54;
+const uint8_t CV55Light0NightBrightness = 55;
+const uint8_t CV56Light0BinaryState = 56;
+const uint8_t CV57Light0PowerPriority = 57;
+const uint8_t CV58Light0Profile = 58;
+const uint8_t CV59Light0Address = 59;
+const uint8_t CV100Light0OnDelay = 100;
+const uint8_t CV101Light0OffDelay = 101;
+const uint8_t CV102Light0OneShotDuration = 102;
+const uint8_t CV103Light0OneShotMode = 103;
+const uint8_t CV104Light0AnalogChannel = 104;
+const uint8_t CV105Light0AnalogMode = 105;
+const uint8_t CV106Light0KickTime = 106;
+const uint8_t CV107Light0HoldDuty = 107;
+const uint8_t CV108Light0MaxOnTime = 108;
+const uint8_t CV109Light0Output = 109;
 
 const uint8_t CV60Light1Brightness = 60;
 const uint8_t CV61Light1ControlFunction = 61;
 const uint8_t CV62Light1DirectionSensitivity = 62;
 const uint8_t CV63Light1SpeedSensitivity = 63;
 const uint8_t CV64Light1Effect = 64;
+const uint8_t CV65Light1NightBrightness = 65;
+const uint8_t CV66Light1BinaryState = 66;
+const uint8_t CV67Light1PowerPriority = 67;
+const uint8_t CV68Light1Profile = 68;
+const uint8_t CV69Light1Address = 69;
+const uint8_t CV110Light1OnDelay = 110;
+const uint8_t CV111Light1OffDelay = 111;
+const uint8_t CV112Light1OneShotDuration = 112;
+const uint8_t CV113Light1OneShotMode = 113;
+const uint8_t CV114Light1AnalogChannel = 114;
+const uint8_t CV115Light1AnalogMode = 115;
+const uint8_t CV116Light1KickTime = 116;
+const uint8_t CV117Light1HoldDuty = 117;
+const uint8_t CV118Light1MaxOnTime = 118;
+const uint8_t CV119Light1Output = 119;
 
 const uint8_t CV70Light2Brightness = 70;
 const uint8_t CV71Light2ControlFunction = 71;
 const uint8_t CV72Light2DirectionSensitivity = 72;
 const uint8_t CV73Light2SpeedSensitivity = 73;
 const uint8_t CV74Light2Effect = 74;
+const uint8_t CV75Light2NightBrightness = 75;
+const uint8_t CV76Light2BinaryState = 76;
+const uint8_t CV77Light2PowerPriority = 77;
+const uint8_t CV78Light2Profile = 78;
+const uint8_t CV79Light2Address = 79;
+const uint8_t CV120Light2OnDelay = 120;
+const uint8_t CV121Light2OffDelay = 121;
+const uint8_t CV122Light2OneShotDuration = 122;
+const uint8_t CV123Light2OneShotMode = 123;
+const uint8_t CV124Light2AnalogChannel = 124;
+const uint8_t CV125Light2AnalogMode = 125;
+const uint8_t CV126Light2KickTime = 126;
+const uint8_t CV127Light2HoldDuty = 127;
+const uint8_t CV128Light2MaxOnTime = 128;
+const uint8_t CV129Light2Output = 129;
 
 const uint8_t CV80Light3Brightness = 80;
 const uint8_t CV81Light3ControlFunction = 81;
 const uint8_t CV82Light3DirectionSensitivity = 82;
 const uint8_t CV83Light3SpeedSensitivity = 83;
 const uint8_t CV84Light3Effect = 84;
+const uint8_t CV85Light3NightBrightness = 85;
+const uint8_t CV86Light3BinaryState = 86;
+const uint8_t CV87Light3PowerPriority = 87;
+const uint8_t CV88Light3Profile = 88;
+const uint8_t CV89Light3Address = 89;
+const uint8_t CV130Light3OnDelay = 130;
+const uint8_t CV131Light3OffDelay = 131;
+const uint8_t CV132Light3OneShotDuration = 132;
+const uint8_t CV133Light3OneShotMode = 133;
+const uint8_t CV134Light3AnalogChannel = 134;
+const uint8_t CV135Light3AnalogMode = 135;
+const uint8_t CV136Light3KickTime = 136;
+const uint8_t CV137Light3HoldDuty = 137;
+const uint8_t CV138Light3MaxOnTime = 138;
+const uint8_t CV139Light3Output = 139;
 
 const uint8_t CV90Light4Brightness = 90;
 const uint8_t CV91Light4ControlFunction = 91;
 const uint8_t CV92Light4DirectionSensitivity = 92;
 const uint8_t CV93Light4SpeedSensitivity = 93;
-const uint8_t CV94Light4Effect = 94; // CV with the highest number
+const uint8_t CV94Light4Effect = 94;
+const uint8_t CV95Light4NightBrightness = 95;
+const uint8_t CV96Light4BinaryState = 96;
+const uint8_t CV97Light4PowerPriority = 97;
+const uint8_t CV98Light4Profile = 98;
+const uint8_t CV99Light4Address = 99;
+const uint8_t CV140Light4OnDelay = 140;
+const uint8_t CV141Light4OffDelay = 141;
+const uint8_t CV142Light4OneShotDuration = 142;
+const uint8_t CV143Light4OneShotMode = 143;
+const uint8_t CV144Light4AnalogChannel = 144;
+const uint8_t CV145Light4AnalogMode = 145;
+const uint8_t CV146Light4KickTime = 146;
+const uint8_t CV147Light4HoldDuty = 147;
+const uint8_t CV148Light4MaxOnTime = 148;
+const uint8_t CV149Light4Output = 149; // CV with the highest number
 
 // cvsCache[] stores the CVs (in RAM, for quickest access)
 // The indexes of the array are the CV numbers
 // cvsCache[cvNumber] = cvValue
-const uint8_t numberOfCvsInCache = CV94Light4Effect + 1; // CV94Light4Effect is the CV with the highest number
+const uint8_t numberOfCvsInCache = CV149Light4Output + 1; // CV149Light4Output is the CV with the highest number
 uint8_t cvsCache[numberOfCvsInCache];
 
 // Structure for CV Values Table and default CV Values table as required by NmraDcc for storing default values
 uint8_t FactoryDefaultCVIndex = 0;
+uint32_t factoryResetLastProgress = 0; // Time (in ms) of the last CV written by a factory reset
 
 struct CVPair
 {
@@ -146,311 +552,2012 @@ struct CVPair
     uint8_t Value;
 };
 
+#ifdef PRODUCT_DEFAULTS
+// Product specific defaults generated by tools/cvcompile.py from a lighting description
+#include "ProductDefaults.h"
+#else
 const CVPair FactoryDefaultCVs[] =
     {
         {CV1PrimaryAddress, 3},
-        {CV7ManufacturerVersionNumber, 1},
+        {CV7ManufacturerVersionNumber, versionId}, // Not older than versionId, see upgradeCVs()
         {CV8ManufacturerIDNumber, 13},
+        {CV15DecoderLock, 0},
+        {CV16DecoderLockId, 0},
         {CV29ModeControl, 0},
+        {CV30DayNightMode, 0},
+        {CV31NightStartHour, 20},
+        {CV32DayStartHour, 6},
+        {CV33NightBinaryState, 0},
+        {CV34EmergencyStopReaction, 0},
+        {CV35EmergencyStopLights, 31},
+        {CV36EffectSyncBinaryState, 0},
+        {CV37EffectSyncFunction, 31},
+        {CV38EffectSyncPeriod, 0},
+        {CV39PowerBudget, 255},
+        {CV40TuningLight, 0},
+        {CV41TuningFunction, 31},
+        {CV42SecondAddressLSB, 0},
+        {CV43SecondAddressMSB, 0},
+        {CV44PowerUpDelay, 0},
+        {CV45PowerUpRamp, 0},
+        {CV46ConfirmCount, 1},
+        {CV47ConfirmWindow, 1},
 
         {CV50Light0Brightness, 144},
         {CV51Light0ControlFunction, 0},
         {CV52Light0DirectionSensitivity, 0},
         {CV53Light0SpeedSensitivity, 0},
         {CV54Light0Effect, 0},
+        {CV55Light0NightBrightness, 144},
+        {CV56Light0BinaryState, 0},
+        {CV57Light0PowerPriority, 0},
+        {CV58Light0Profile, 0},
+        {CV59Light0Address, 0},
+        {CV100Light0OnDelay, 0},
+        {CV101Light0OffDelay, 0},
+        {CV102Light0OneShotDuration, 0},
+        {CV103Light0OneShotMode, 0},
+        {CV104Light0AnalogChannel, 0},
+        {CV105Light0AnalogMode, 0},
+        {CV106Light0KickTime, 0},
+        {CV107Light0HoldDuty, 255},
+        {CV108Light0MaxOnTime, 0},
+        {CV109Light0Output, 0},
 
         {CV60Light1Brightness, 144},
         {CV61Light1ControlFunction, 1},
         {CV62Light1DirectionSensitivity, 0},
         {CV63Light1SpeedSensitivity, 0},
         {CV64Light1Effect, 0},
+        {CV65Light1NightBrightness, 144},
+        {CV66Light1BinaryState, 0},
+        {CV67Light1PowerPriority, 0},
+        {CV68Light1Profile, 0},
+        {CV69Light1Address, 0},
+        {CV110Light1OnDelay, 0},
+        {CV111Light1OffDelay, 0},
+        {CV112Light1OneShotDuration, 0},
+        {CV113Light1OneShotMode, 0},
+        {CV114Light1AnalogChannel, 0},
+        {CV115Light1AnalogMode, 0},
+        {CV116Light1KickTime, 0},
+        {CV117Light1HoldDuty, 255},
+        {CV118Light1MaxOnTime, 0},
+        {CV119Light1Output, 1},
 
         {CV70Light2Brightness, 144},
         {CV71Light2ControlFunction, 2},
         {CV72Light2DirectionSensitivity, 0},
         {CV73Light2SpeedSensitivity, 0},
         {CV74Light2Effect, 0},
+        {CV75Light2NightBrightness, 144},
+        {CV76Light2BinaryState, 0},
+        {CV77Light2PowerPriority, 0},
+        {CV78Light2Profile, 0},
+        {CV79Light2Address, 0},
+        {CV120Light2OnDelay, 0},
+        {CV121Light2OffDelay, 0},
+        {CV122Light2OneShotDuration, 0},
+        {CV123Light2OneShotMode, 0},
+        {CV124Light2AnalogChannel, 0},
+        {CV125Light2AnalogMode, 0},
+        {CV126Light2KickTime, 0},
+        {CV127Light2HoldDuty, 255},
+        {CV128Light2MaxOnTime, 0},
+        {CV129Light2Output, 2},
 
         {CV80Light3Brightness, 144},
         {CV81Light3ControlFunction, 3},
         {CV82Light3DirectionSensitivity, 0},
         {CV83Light3SpeedSensitivity, 0},
         {CV84Light3Effect, 0},
+        {CV85Light3NightBrightness, 144},
+        {CV86Light3BinaryState, 0},
+        {CV87Light3PowerPriority, 0},
+        {CV88Light3Profile, 0},
+        {CV89Light3Address, 0},
+        {CV130Light3OnDelay, 0},
+        {CV131Light3OffDelay, 0},
+        {CV132Light3OneShotDuration, 0},
+        {CV133Light3OneShotMode, 0},
+        {CV134Light3AnalogChannel, 0},
+        {CV135Light3AnalogMode, 0},
+        {CV136Light3KickTime, 0},
+        {CV137Light3HoldDuty, 255},
+        {CV138Light3MaxOnTime, 0},
+        {CV139Light3Output, 3},
 
         {CV90Light4Brightness, 144},
         {CV91Light4ControlFunction, 4},
         {CV92Light4DirectionSensitivity, 0},
         {CV93Light4SpeedSensitivity, 0},
-        {CV94Light4Effect, 0}};
-
-// This callback function is called when a CV Value changes so we can update cvsCache[]
-void notifyCVChange(uint16_t CV, uint8_t Value)
-{
-#ifdef DEBUG
-    Serial.print("notifyCVChange: CV: ");
-    Serial.print(CV);
-    Serial.print(" Value: ");
-    Serial.println(Value);
+        {CV94Light4Effect, 0},
+        {CV95Light4NightBrightness, 144},
+        {CV96Light4BinaryState, 0},
+        {CV97Light4PowerPriority, 0},
+        {CV98Light4Profile, 0},
+        {CV99Light4Address, 0},
+        {CV140Light4OnDelay, 0},
+        {CV141Light4OffDelay, 0},
+        {CV142Light4OneShotDuration, 0},
+        {CV143Light4OneShotMode, 0},
+        {CV144Light4AnalogChannel, 0},
+        {CV145Light4AnalogMode, 0},
+        {CV146Light4KickTime, 0},
+        {CV147Light4HoldDuty, 255},
+        {CV148Light4MaxOnTime, 0},
+        {CV149Light4Output, 4}};
 #endif
 
-    if (CV < numberOfCvsInCache)
-        cvsCache[CV] = Value;
+// Write a block of bytes to the EEPROM with a single erase/write operation per page
+// The page buffer is loaded through the memory mapped EEPROM, which is much faster than writing byte by byte
+// Only the bytes loaded in the page buffer are erased and written, the rest of the page is kept
+const uint8_t eepromPageSize = EEPROM_PAGE_SIZE;
+
+void eepromWriteBlock(uint8_t address, const uint8_t *data, uint8_t length)
+{
+    while (length)
+    {
+        while (NVMCTRL.STATUS & NVMCTRL_EEBUSY_bm)
+            ;
+        _PROTECTED_WRITE_SPM(NVMCTRL.CTRLA, NVMCTRL_CMD_PAGEBUFCLR_gc);
+        do
+        {
+            *(volatile uint8_t *)(EEPROM_START + address) = *data++;
+            address++;
+            length--;
+        } while (length && (address % eepromPageSize) != 0);
+        _PROTECTED_WRITE_SPM(NVMCTRL.CTRLA, NVMCTRL_CMD_PAGEERASEWRITE_gc);
+    }
+    while (NVMCTRL.STATUS & NVMCTRL_EEBUSY_bm)
+        ;
 }
 
-// This callback function is called when the CVs must be reset to their factory defaults
-// Make FactoryDefaultCVIndex non-zero and equal to the number of CVs to be reset
-// to flag to the loop() function that a reset to factory defaults needs to be done
-void notifyCVResetFactoryDefault()
+// Flight recorder, see the description at the top of this file
+enum FlightRecorderEvent : uint8_t
 {
-#ifdef DEBUG
-    Serial.println("notifyCVResetFactoryDefault");
-#endif
-    FactoryDefaultCVIndex = sizeof(FactoryDefaultCVs) / sizeof(CVPair);
+    EventBoot = 1,         // Data: reset flags
+    EventSpeed,            // Data: speed, bit 7 set for forward
+    EventEmergencyStop,    // Data: 0
+    EventFunction,         // Data: state of F0 to F4 (as in the DCC packet)
+    EventBinaryState,      // Data: binary state number
+    EventCVChange,         // Data: CV number
+    EventCVAck,            // Data: 0
+    EventFactoryReset,     // Data: 0
+    EventEepromWrite,      // Data: EEPROM address
+    EventDriveCutoff       // Data: light number
 };
 
-// Function called at setup time to load all CVs to the array cvsCache[] in memory
-// Only the CVs used (i.e. listed in FactoryDefaultCVs) are read
-void readCvsToCache()
+struct FlightRecorderEntry
 {
-    for (uint8_t i = 0; i < sizeof(FactoryDefaultCVs) / sizeof(CVPair); i++)
-    {
-        uint16_t cvNr = FactoryDefaultCVs[i].CV;
-        cvsCache[cvNr] = Dcc.getCV(cvNr);
-#ifdef DEBUG
-        Serial.print("CV");
-        Serial.print(cvNr);
-        Serial.print("=");
-        Serial.print(cvsCache[cvNr]);
-        Serial.print("|");
-#endif
-    }
-#ifdef DEBUG
-    Serial.println();
-#endif
+    uint16_t time;
+    uint8_t event;
+    uint8_t data;
+};
+
+const uint8_t flightRecorderSize = 11;
+const uint8_t flightRecorderEepromAddress = 208;
+const uint8_t flightRecorderMagic = 0xA5;
+
+struct FlightRecorder
+{
+    uint8_t magic;
+    uint8_t next; // Index of the next entry to write (i.e. of the oldest entry)
+    uint8_t count;
+    FlightRecorderEntry entries[flightRecorderSize];
+};
+
+// Not cleared at reset, so that the events before a reset can be saved
+FlightRecorder flightRecorder __attribute__((section(".noinit")));
+
+void recordEvent(FlightRecorderEvent event, uint8_t data)
+{
+    FlightRecorderEntry *entry = &flightRecorder.entries[flightRecorder.next];
+    entry->time = (uint16_t)(millis() >> 4);
+    entry->event = event;
+    entry->data = data;
+    if (++flightRecorder.next == flightRecorderSize)
+        flightRecorder.next = 0;
+    if (flightRecorder.count < flightRecorderSize)
+        flightRecorder.count++;
 }
 
-// Compute and store in lightCache[] the state (ON/OFF) of the lights
-// To be called whenever one of the underlying parameters (CVs, Fcts, speed, direction) changes
-void updateLightCache()
+// Called at boot. Save the events to the EEPROM after an unexpected reset, then restart recording
+void initFlightRecorder(uint8_t resetFlags)
 {
-#ifdef DEBUG
-    Serial.print("updateLightCache: ");
-#endif
-    for (uint8_t lightNr = 0; lightNr < numberOfLights; lightNr++)
+    if ((resetFlags & (RSTCTRL_WDRF_bm | RSTCTRL_BORF_bm | RSTCTRL_SWRF_bm)) && !(resetFlags & RSTCTRL_PORF_bm) &&
+        flightRecorder.magic == flightRecorderMagic && flightRecorder.next < flightRecorderSize &&
+        flightRecorder.count <= flightRecorderSize)
     {
-        uint8_t lightNrOffset = lightNr * 10;
-        // Make sure that the function number is not higher than F4
-        if (cvsCache[CV51Light0ControlFunction + lightNrOffset] > (numberOfFctsInCache - 1))
-            cvsCache[CV51Light0ControlFunction + lightNrOffset] = 31;
-        lightCache[lightNr] =
-            (bool)((cvsCache[CV51Light0ControlFunction + lightNrOffset] == 31 || fctsCache[cvsCache[CV51Light0ControlFunction + lightNrOffset]]) &&
-                   (cvsCache[CV52Light0DirectionSensitivity + lightNrOffset] == 0 || (cvsCache[CV52Light0DirectionSensitivity + lightNrOffset] == 1 && currentDirection == DCC_DIR_FWD) || (cvsCache[CV52Light0DirectionSensitivity + lightNrOffset] == 2 && currentDirection == DCC_DIR_REV)) &&
-                   (cvsCache[CV53Light0SpeedSensitivity + lightNrOffset] == 0 || (cvsCache[CV53Light0SpeedSensitivity + lightNrOffset] == 1 && currentSpeed > 1)));
-#ifdef DEBUG
-        Serial.print(lightNr);
-        Serial.print("=");
-        Serial.print(lightCache[lightNr]);
-        Serial.print("|");
-#endif
+        uint8_t header[2] = {resetFlags, flightRecorder.count};
+        eepromWriteBlock(flightRecorderEepromAddress, header, sizeof(header));
+        uint8_t index = (flightRecorder.next + flightRecorderSize - flightRecorder.count) % flightRecorderSize;
+        for (uint8_t i = 0; i < flightRecorder.count; i++)
+        {
+            eepromWriteBlock(flightRecorderEepromAddress + sizeof(header) + i * sizeof(FlightRecorderEntry),
+                             (const uint8_t *)&flightRecorder.entries[index], sizeof(FlightRecorderEntry));
+            index = (index + 1) % flightRecorderSize;
+        }
     }
-#ifdef DEBUG
-    Serial.println();
-#endif
+    flightRecorder.magic = flightRecorderMagic;
+    flightRecorder.next = 0;
+    flightRecorder.count = 0;
+    recordEvent(EventBoot, resetFlags);
 }
 
-// This callback function is called whenever we receive a DCC speed packet for our address
-void notifyDccSpeed(uint16_t Addr, DCC_ADDR_TYPE AddrType, uint8_t Speed, DCC_DIRECTION Dir, DCC_SPEED_STEPS SpeedSteps)
-{
-    if (currentDirection != Dir || currentSpeed != Speed || currentSpeedSteps != SpeedSteps)
-    {
-#ifdef DEBUG
-        Serial.print("notifyDccSpeed: Speed=");
-        Serial.print(Speed, DEC);
-        Serial.print("|Steps=");
-        Serial.print(SpeedSteps, DEC);
-        Serial.print("|Dir=");
-        Serial.println((Dir == DCC_DIR_FWD) ? "Fwd" : "Rev");
-#endif
+// Reset counters, stored in the EEPROM and readable as CV150 to CV153
+const uint8_t resetCountersEepromAddress = 150;
+const uint8_t resetCountersFlags[] = {RSTCTRL_WDRF_bm, RSTCTRL_BORF_bm, RSTCTRL_PORF_bm, RSTCTRL_SWRF_bm};
+const uint8_t numberOfResetCounters = sizeof(resetCountersFlags);
 
-        currentDirection = Dir;
-        currentSpeed = Speed;
-        currentSpeedSteps = SpeedSteps;
-        updateLightCache();
-    }
-};
+const uint8_t resetCountersMax = 254;   // 0xFF is an erased counter
 
-// This callback function is called whenever we receive a DCC Function packet for our address
-void notifyDccFunc(uint16_t Addr, DCC_ADDR_TYPE AddrType, FN_GROUP FuncGrp, uint8_t FuncState)
+// Called at boot to count the cause(s) of the reset. Counters saturate at resetCountersMax
+// An erased counter is started from 0
+void updateResetCounters(uint8_t resetFlags)
 {
-    // Check that the DCC packet is for functions 0 to 4 (the only functions we use)
-    // Check that one of the functions has changed
-    if (FuncGrp == FN_0_4 && currentFuncState != FuncState)
+    for (uint8_t i = 0; i < numberOfResetCounters; i++)
     {
-#ifdef DEBUG
-        Serial.print("Function Group: ");
-        Serial.print(FuncGrp);
-        Serial.print("|State = 0b");
-        Serial.println(FuncState, BIN);
-#endif
-        currentFuncState = FuncState;
-        fctsCache[0] = (bool)(FuncState & FN_BIT_00);
-        fctsCache[1] = (bool)(FuncState & FN_BIT_01);
-        fctsCache[2] = (bool)(FuncState & FN_BIT_02);
-        fctsCache[3] = (bool)(FuncState & FN_BIT_03);
-        fctsCache[4] = (bool)(FuncState & FN_BIT_04);
-        updateLightCache();
-        EEPROM.write(fctsEepromAddress, FuncState);
+        uint8_t count = EEPROM.read(resetCountersEepromAddress + i);
+        uint8_t newCount = (count == 0xFF) ? 0 : count;
+        if ((resetFlags & resetCountersFlags[i]) && newCount != resetCountersMax)
+            newCount++;
+        if (newCount != count)
+            EEPROM.write(resetCountersEepromAddress + i, newCount);
     }
 }
 
-void readFctsToCache()
+// Operating hours and energy of lights, see the description at the top of this file
+struct LightUsage
 {
-    uint8_t FuncState = EEPROM.read(fctsEepromAddress);
-    currentFuncState = FuncState;
-    fctsCache[0] = (bool)(FuncState & FN_BIT_00);
-    fctsCache[1] = (bool)(FuncState & FN_BIT_01);
-    fctsCache[2] = (bool)(FuncState & FN_BIT_02);
-    fctsCache[3] = (bool)(FuncState & FN_BIT_03);
-    fctsCache[4] = (bool)(FuncState & FN_BIT_04);
-}
+    uint16_t onTime; // In 0.1 h
+    uint16_t energy; // In 0.1 h at full duty
+};
 
-// Period (in ms) of light flash
-const uint32_t strobeFlashPeriod = 150;
-const uint32_t rotatingFlashPeriod = 600;
+// Packed: the slots are saved byte for byte, so the layout must be the AVR one on every target (host tests)
+struct __attribute__((packed)) LightUsageRecord
+{
+    uint8_t sequence;
+    LightUsage lights[numberOfLights];
+    uint8_t fractions[numberOfLights]; // In 1/16 of the units: on-time in bits 0-3, energy in bits 4-7
+    uint8_t checksum;
+};
+static_assert(sizeof(LightUsageRecord) == 27, "LightUsageRecord must match the EEPROM slots (154 to 207)");
 
-// Gamma table
-const uint8_t gamma[] = {
-    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1,
-    1, 1, 1, 1, 1, 1, 1, 1, 1, 2, 2, 2, 2, 2, 2, 2,
-    2, 3, 3, 3, 3, 3, 3, 3, 4, 4, 4, 4, 4, 5, 5, 5,
-    5, 6, 6, 6, 6, 7, 7, 7, 7, 8, 8, 8, 9, 9, 9, 10,
-    10, 10, 11, 11, 11, 12, 12, 13, 13, 13, 14, 14, 15, 15, 16, 16,
-    17, 17, 18, 18, 19, 19, 20, 20, 21, 21, 22, 22, 23, 24, 24, 25,
-    25, 26, 27, 27, 28, 29, 29, 30, 31, 32, 32, 33, 34, 35, 35, 36,
-    37, 38, 39, 39, 40, 41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 50,
-    51, 52, 54, 55, 56, 57, 58, 59, 60, 61, 62, 63, 64, 66, 67, 68,
-    69, 70, 72, 73, 74, 75, 77, 78, 79, 81, 82, 83, 85, 86, 87, 89,
-    90, 92, 93, 95, 96, 98, 99, 101, 102, 104, 105, 107, 109, 110, 112, 114,
-    115, 117, 119, 120, 122, 124, 126, 127, 129, 131, 133, 135, 137, 138, 140, 142,
-    144, 146, 148, 150, 152, 154, 156, 158, 160, 162, 164, 167, 169, 171, 173, 175,
-    177, 180, 182, 184, 186, 189, 191, 193, 196, 198, 200, 203, 205, 208, 210, 213,
-    215, 218, 220, 223, 225, 228, 231, 233, 236, 239, 241, 244, 247, 249, 252, 255};
+const uint8_t lightUsageEepromAddress = 154;
+const uint8_t numberOfLightUsageSlots = 2;
+const uint8_t lightUsageCVs = 4; // Number of CVs per light
+const uint32_t lightUsageSaveInterval = 120000; // 2 min: a slot endures 100000 writes in 6000 h of lights on
+const uint16_t lightUsageTicksPerUnit = 3600;   // Ticks in 0.1 h
+const uint16_t lightUsageTicksPerFraction = lightUsageTicksPerUnit / 16;
 
-uint8_t valueLight(uint8_t lightNr)
+LightUsageRecord lightUsage;
+uint8_t lightUsageSlot = 0;           // Slot of the last save
+uint16_t lightOnTicks[numberOfLights];  // Fraction of lightUsage.lights[].onTime, in ticks
+uint32_t lightDutyTicks[numberOfLights]; // Fraction of lightUsage.lights[].energy, in ticks x duty
+bool lightUsageChanged = false;
+uint32_t lightUsageLastSave = 0;
+
+// lightDuty[] stores the duty currently output on each light
+uint8_t lightDuty[numberOfLights];
+
+uint8_t lightUsageChecksum(const LightUsageRecord *record)
 {
-    uint32_t timeNow;
-    uint8_t lightNrOffset = lightNr * 10;
-    if (lightCache[lightNr])
+    const uint8_t *data = (const uint8_t *)record;
+    uint8_t checksum = 0x5A;
+    for (uint8_t i = 0; i < sizeof(LightUsageRecord) - 1; i++)
+        checksum += data[i];
+    return (checksum);
+}
+
+// Called at boot. Load the most recent valid slot
+void readLightUsage()
+{
+    LightUsageRecord record;
+    bool found = false;
+    for (uint8_t slot = 0; slot < numberOfLightUsageSlots; slot++)
     {
-        switch (cvsCache[CV54Light0Effect + lightNrOffset])
+        uint8_t *data = (uint8_t *)&record;
+        for (uint8_t i = 0; i < sizeof(LightUsageRecord); i++)
+            data[i] = EEPROM.read(lightUsageEepromAddress + slot * sizeof(LightUsageRecord) + i);
+        if (record.checksum == lightUsageChecksum(&record) && (!found || (int8_t)(record.sequence - lightUsage.sequence) > 0))
         {
-        case 0: // Always on
-            return (gamma[cvsCache[CV50Light0Brightness + lightNrOffset]]);
-            break;
-
-        case 1: // Strobe flash
-            timeNow = millis() % strobeFlashPeriod;
-            if (timeNow < (strobeFlashPeriod / 12))
-                return (gamma[cvsCache[CV50Light0Brightness + lightNrOffset]]);
-            else
-                return (0);
-            break;
-
-        case 2: // Rotating flash
-            timeNow = millis() % rotatingFlashPeriod;
-            if (timeNow < (rotatingFlashPeriod / 2))
-                return (gamma[(uint8_t)((2 * cvsCache[CV50Light0Brightness + lightNrOffset] * timeNow) / rotatingFlashPeriod)]);
-            else
-                return (gamma[(uint8_t)((2 * cvsCache[CV50Light0Brightness + lightNrOffset] * (rotatingFlashPeriod - timeNow)) / rotatingFlashPeriod)]);
-            break;
+            lightUsage = record;
+            lightUsageSlot = slot;
+            found = true;
         }
     }
-    else
-        return (0);
+    if (!found)
+    {
+        for (uint8_t lightNr = 0; lightNr < numberOfLights; lightNr++)
+        {
+            lightUsage.lights[lightNr] = {0, 0};
+            lightOnTicks[lightNr] = 0;
+            lightDutyTicks[lightNr] = 0;
+        }
+        lightUsage.sequence = 0;
+        lightUsageSlot = numberOfLightUsageSlots - 1;
+        return;
+    }
+    // Restore the fractions to the middle of their 1/16, the time since the save being unknown
+    for (uint8_t lightNr = 0; lightNr < numberOfLights; lightNr++)
+    {
+        uint8_t fractions = lightUsage.fractions[lightNr];
+        lightOnTicks[lightNr] = (fractions & 0x0F) * lightUsageTicksPerFraction + lightUsageTicksPerFraction / 2;
+        lightDutyTicks[lightNr] = ((fractions >> 4) * lightUsageTicksPerFraction + lightUsageTicksPerFraction / 2) * (uint32_t)255;
+    }
 }
 
-// This callback function is called by the NmraDcc library when a DCC ACK needs to be sent
-// Calling this function should cause an increased 60mA current drain on the power supply for 6ms to ACK a CV Read
-void notifyCVAck(void)
+// Save the totals in the slot after the one of the last save
+void saveLightUsage()
 {
-#ifdef DEBUG
-    Serial.println("notifyCVAck");
-#endif
-
-    digitalWrite(pinACKOutput, HIGH);
-    delay(8);
-    digitalWrite(pinACKOutput, LOW);
+    lightUsageSlot = (lightUsageSlot + 1) % numberOfLightUsageSlots;
+    lightUsage.sequence++;
+    for (uint8_t lightNr = 0; lightNr < numberOfLights; lightNr++)
+        lightUsage.fractions[lightNr] = (lightOnTicks[lightNr] / lightUsageTicksPerFraction) |
+                                        ((lightDutyTicks[lightNr] / (lightUsageTicksPerFraction * (uint32_t)255)) << 4);
+    lightUsage.checksum = lightUsageChecksum(&lightUsage);
+    recordEvent(EventEepromWrite, lightUsageEepromAddress + lightUsageSlot * sizeof(LightUsageRecord));
+    eepromWriteBlock(lightUsageEepromAddress + lightUsageSlot * sizeof(LightUsageRecord), (const uint8_t *)&lightUsage, sizeof(LightUsageRecord));
 }
 
-void setup()
+// Called every tick: accumulate the on-time and the duty of lights, and save the totals periodically
+void updateLightUsage()
 {
-    // Set light pins and DCC ACK pin to outputs
     for (uint8_t lightNr = 0; lightNr < numberOfLights; lightNr++)
     {
-        analogWrite(pinLight[lightNr], 0);
-        pinMode(pinLight[lightNr], OUTPUT);
+        if (lightDuty[lightNr] == 0)
+            continue;
+        lightUsageChanged = true;
+        if (++lightOnTicks[lightNr] == lightUsageTicksPerUnit)
+        {
+            lightOnTicks[lightNr] = 0;
+            lightUsage.lights[lightNr].onTime++;
+        }
+        lightDutyTicks[lightNr] += lightDuty[lightNr];
+        if (lightDutyTicks[lightNr] >= (uint32_t)lightUsageTicksPerUnit * 255)
+        {
+            lightDutyTicks[lightNr] -= (uint32_t)lightUsageTicksPerUnit * 255;
+            lightUsage.lights[lightNr].energy++;
+        }
     }
 
-    digitalWrite(pinACKOutput, 0);
-    pinMode(pinACKOutput, OUTPUT);
+    if (lightUsageChanged && millis() - lightUsageLastSave >= lightUsageSaveInterval)
+    {
+        lightUsageLastSave = millis();
+        lightUsageChanged = false;
+        saveLightUsage();
+    }
+}
 
-#ifdef DEBUG
-    // Serial TX used for debugging messages
-    // Two mapping options for Serial are PB2, PB3, PB1, PB0 (default) and PA1, PA2, PA3, PA4 for TX, RX, XCK, XDIR.
-    Serial.swap(); // Use the second set of serial pins. TX is on PA1
-    Serial.begin(115200);
-    Serial.println();
-    Serial.println("-- Starting tiny DCC decoder --");
-#endif
+#ifdef ISR_PROFILE
+// Interrupt profiling, see the description at the top of this file
+const uint8_t isrHistogramBins = 6;
+const uint8_t isrHistogramShift = 5;     // The first bin is below 1 << isrHistogramShift TCB clocks (3.2 us)
+const uint16_t isrProbePeriod = 9973;    // TCB clocks, about 1 ms
+const uint8_t isrHistogramsCV = 174;     // First CV of the histograms
 
-    readFctsToCache();
+volatile uint16_t isrHistograms[2][isrHistogramBins]; // DCC edge to end of the NmraDcc ISR, probe latency
 
-    // Initialize the NmraDcc library
-    // void NmraDcc::pin (uint8_t ExtIntPinNum, uint8_t EnablePullup)
-    // void NmraDcc::init (uint8_t ManufacturerId, uint8_t VersionId, uint8_t Flags, uint8_t OpsModeAddressBaseCV)
-    Dcc.pin(pinDCCInput, false);
-    Dcc.init(MAN_ID_DIY, versionId, FLAGS_MY_ADDRESS_ONLY | FLAGS_AUTO_FACTORY_DEFAULT, 0);
+void isrHistogramAdd(volatile uint16_t *histogram, uint16_t clocks)
+{
+    uint8_t bin = 0;
+    for (clocks >>= isrHistogramShift; clocks != 0 && bin < isrHistogramBins - 1; clocks >>= 1)
+        bin++;
+    if (++histogram[bin] == 0xFFFF)
+        for (uint8_t i = 0; i < isrHistogramBins; i++)
+            histogram[i] >>= 1;
+}
 
-    // Commented out as not necessary with Attiny
-    // notifyCVResetFactoryDefault() is automatically called
-    // at very first call (i.e. unprogrammed EEPROM) of NmraDcc::init() with FLAGS_AUTO_FACTORY_DEFAULT set
-    // notifyCVResetFactoryDefault();
+// Rising edge of the DCC input, captured by TCB0 through the event system, after the NmraDcc ISR of the same edge
+ISR(TCB0_INT_vect)
+{
+    uint16_t now = TCB0.CNT;
+    isrHistogramAdd(isrHistograms[0], now - TCB0.CCMP); // Reading CCMP clears the interrupt flag
+}
 
-    readCvsToCache();
-    updateLightCache();
+// Probe: TCB1 restarts from 0 when it raises the interrupt, so its counter at the ISR entry is the latency
+ISR(TCB1_INT_vect)
+{
+    uint16_t latency = TCB1.CNT;
+    TCB1.INTFLAGS = TCB_CAPT_bm;
+    isrHistogramAdd(isrHistograms[1], latency);
 }
 
-#ifdef DEBUG
-uint16_t loopCounterLow = 20000;
-uint16_t loopCounterHigh = 0;
-#endif
+// Called at boot, after Dcc.init() has set up the DCC input
+void initIsrProfile()
+{
+    EVSYS.ASYNCCH0 = EVSYS_ASYNCCH0_PORTA_PIN2_gc; // pinDCCInput
+    EVSYS.ASYNCUSER0 = EVSYS_ASYNCUSER0_ASYNCCH0_gc; // TCB0 capture
+    TCB0.CTRLB = TCB_CNTMODE_CAPT_gc;
+    TCB0.EVCTRL = TCB_CAPTEI_bm;
+    TCB0.INTCTRL = TCB_CAPT_bm;
+    TCB0.CTRLA = TCB_CLKSEL_CLKDIV2_gc | TCB_ENABLE_bm;
 
-void loop()
+    TCB1.CCMP = isrProbePeriod;
+    TCB1.CTRLB = TCB_CNTMODE_INT_gc;
+    TCB1.INTCTRL = TCB_CAPT_bm;
+    TCB1.CTRLA = TCB_CLKSEL_CLKDIV2_gc | TCB_ENABLE_bm;
+}
+
+// CV value of the histograms (CV174 to CV197), read atomically as the ISRs update them
+uint8_t readIsrHistogramCV(uint16_t CV)
 {
-#ifdef DEBUG
-    if (loopCounterLow == 20000)
-    {
-        loopCounterLow = 0;
-        Serial.print("loop ");
-        Serial.println(loopCounterHigh);
-        loopCounterHigh++;
-    }
-    loopCounterLow++;
+    uint8_t index = CV - isrHistogramsCV;
+    noInterrupts();
+    uint16_t count = isrHistograms[index / (2 * isrHistogramBins)][(index / 2) % isrHistogramBins];
+    interrupts();
+    return ((index % 2) ? count >> 8 : count & 0xFF);
+}
 #endif
 
-    // Process DCC packets
-    Dcc.process();
+// Parameters of a light, in the order of its CVs (CV50 to CV57 for Light0)
+struct LightParams
+{
+    uint8_t brightness;
+    uint8_t controlFunction;
+    uint8_t directionSensitivity;
+    uint8_t speedSensitivity;
+    uint8_t effect;
+    uint8_t nightBrightness;
+    uint8_t binaryState;
+    uint8_t powerPriority;
+};
+static_assert(sizeof(LightParams) == CV58Light0Profile - CV50Light0Brightness, "LightParams must match the light CVs");
 
-    // Process the value of light outputs
-    // We use analogWrite() as all output pins support PWM
-    for (uint8_t lightNr = 0; lightNr < numberOfLights; lightNr++)
-        analogWrite(pinLight[lightNr], valueLight(lightNr));
+// Stock light profiles, selected by CV58
+// The flash is mapped in the data space of the attiny1616, so const data stay in flash and are read in place
+const LightParams lightProfiles[] = {
+    {200, 0, 1, 0, 0, 200, 0, 1}, // 1: Headlight, F0, forward only, protected
+    {200, 0, 2, 0, 0, 200, 0, 1}, // 2: Rear light, F0, reverse only, protected
+    {80, 1, 0, 0, 0, 120, 0, 0},  // 3: Cab light, F1, brighter at night
+    {144, 2, 0, 0, 2, 144, 0, 0}, // 4: Rotating beacon, F2
+    {144, 3, 0, 1, 1, 144, 0, 0}, // 5: Strobe, F3, only when moving
+};
+const uint8_t numberOfLightProfiles = sizeof(lightProfiles) / sizeof(LightParams);
+const uint8_t profileOwnBrightness = 0x80; // CV58 bit: the brightness CVs of the light override the profile
+
+// lightParams[] points to the parameters of each light: its CVs in cvsCache[] or a stock profile in flash
+// The profiles are not copied to RAM. The CVs of the light stay cached whatever CV58, so a profile saves no RAM
+const LightParams *lightParams[numberOfLights];
+
+// Parameters holding the brightness of a light: its own CVs when CV58 overrides the brightness of the profile
+inline const LightParams *lightBrightnessParams(uint8_t lightNr)
+{
+    if (cvsCache[CV58Light0Profile + lightNr * 10] & profileOwnBrightness)
+        return ((const LightParams *)&cvsCache[CV50Light0Brightness + lightNr * 10]);
+    return (lightParams[lightNr]);
+}
+
+// To be called whenever one of the profile CVs changes
+void updateLightParams()
+{
+    for (uint8_t lightNr = 0; lightNr < numberOfLights; lightNr++)
+    {
+        uint8_t profileNr = cvsCache[CV58Light0Profile + lightNr * 10] & ~profileOwnBrightness;
+        if (profileNr != 0 && profileNr <= numberOfLightProfiles)
+            lightParams[lightNr] = &lightProfiles[profileNr - 1];
+        else
+            lightParams[lightNr] = (const LightParams *)&cvsCache[CV50Light0Brightness + lightNr * 10];
+    }
+}
+
+// nightMode is true when the night profile is selected (see CV30 and notifyDccMsg())
+bool nightMode = false;
+
+// Tuning mode, see CV40 and CV41
+// While tuningActive is true, tuningBrightness replaces the brightness CV (CV50 or CV55) of the light tuned
+bool tuningActive = false;
+uint8_t tuningBrightness;
+
+// Analog brightness level (0..255) received in analog function group packets, see CV104 and CV105
+uint8_t analogLevel[numberOfLights] = {255, 255, 255, 255, 255};
+
+// lightBrightness[] stores the brightness (before gamma correction) of lights for the current day/night profile,
+// scaled by the analog level. It is computed only when the profile, a brightness CV or an analog level changes,
+// so valueLight() pays nothing for the profiles and the analog control
+uint8_t lightBrightness[numberOfLights];
+
+void updateLightBrightness()
+{
+    for (uint8_t lightNr = 0; lightNr < numberOfLights; lightNr++)
+    {
+        uint8_t brightness;
+        if (tuningActive && lightNr + 1 == cvsCache[CV40TuningLight])
+            brightness = tuningBrightness;
+        else if (nightMode && cvsCache[CV30DayNightMode] != 0)
+            brightness = lightBrightnessParams(lightNr)->nightBrightness;
+        else
+            brightness = lightBrightnessParams(lightNr)->brightness;
+        if (cvsCache[CV104Light0AnalogChannel + lightNr * 10] != 0 && cvsCache[CV105Light0AnalogMode + lightNr * 10] == 0)
+            brightness = ((uint16_t)brightness * (analogLevel[lightNr] + 1)) >> 8;
+        lightBrightness[lightNr] = brightness;
+    }
+}
+
+void setNightMode(bool night)
+{
+    if (nightMode != night)
+    {
+#ifdef DEBUG
+        Serial.print("setNightMode: ");
+        Serial.println(night);
+#endif
+        nightMode = night;
+        updateLightBrightness();
+    }
+}
+
+// Binary states 1..255 (set by binary state control packets, short or long form)
+// binaryStates[] holds the value of every state, binaryStatesUsed[] flags the states used by lights or CV33
+// Both are bit arrays indexed by the state number, so a lookup is constant time whatever the number of states used
+const uint8_t numberOfBinaryStateBytes = 256 / 8;
+uint8_t binaryStates[numberOfBinaryStateBytes];
+uint8_t binaryStatesUsed[numberOfBinaryStateBytes];
+
+inline bool getBinaryState(const uint8_t *bitArray, uint8_t number)
+{
+    return (bitArray[number >> 3] & (1 << (number & 0x07)));
+}
+
+inline void setBinaryState(uint8_t *bitArray, uint8_t number, bool state)
+{
+    if (state)
+        bitArray[number >> 3] |= 1 << (number & 0x07);
+    else
+        bitArray[number >> 3] &= ~(1 << (number & 0x07));
+}
+
+// To be called whenever one of the binary state CVs changes
+void updateBinaryStatesUsed()
+{
+    for (uint8_t i = 0; i < numberOfBinaryStateBytes; i++)
+        binaryStatesUsed[i] = 0;
+    for (uint8_t lightNr = 0; lightNr < numberOfLights; lightNr++)
+        setBinaryState(binaryStatesUsed, lightParams[lightNr]->binaryState, true);
+    setBinaryState(binaryStatesUsed, cvsCache[CV33NightBinaryState], true);
+    setBinaryState(binaryStatesUsed, cvsCache[CV36EffectSyncBinaryState], true);
+    // State 0 means "none"
+    setBinaryState(binaryStatesUsed, 0, false);
+}
+
+// Power budget (CV39) as a total duty, and bits of the protected lights (CV57)
+uint16_t powerBudget;
+uint8_t powerProtectedLights;
+
+void updatePowerBudget()
+{
+    powerBudget = cvsCache[CV39PowerBudget] * numberOfLights;
+    powerProtectedLights = 0;
+    for (uint8_t lightNr = 0; lightNr < numberOfLights; lightNr++)
+        if (lightParams[lightNr]->powerPriority != 0)
+            powerProtectedLights |= 1 << lightNr;
+}
+
+// lightCompare[] is the compare register driving each light, resolved from the routing CVs (CV109 for Light0)
+// when one of them changes, so that updateLightOutputs() writes the duty without any lookup
+// lightCompareEnableBit[] is the bit of TCA0.SPLIT.CTRLB connecting the pad of the light to this compare
+register8_t *lightCompare[numberOfLights];
+uint8_t lightCompareEnableBit[numberOfLights];
+
+void updateLightRouting()
+{
+    for (uint8_t pad = 0; pad < numberOfLights; pad++)
+        *padCompare[pad] = 0; // Pads no longer driven are turned off
+    for (uint8_t lightNr = 0; lightNr < numberOfLights; lightNr++)
+    {
+        uint8_t pad = cvsCache[CV109Light0Output + lightNr * 10];
+        if (pad >= numberOfLights)
+            pad = lightNr;
+        lightCompare[lightNr] = padCompare[pad];
+        lightCompareEnableBit[lightNr] = padCompareEnableBit[pad];
+    }
+}
+
+// Bits of the lights driven with a kick-and-hold profile (CV106 or CV108 set), see updateDriveOutputs()
+uint8_t driveLights = 0;
+uint8_t driveLightsOn = 0; // Bits of the driven lights seen on by updateDriveOutputs()
+uint8_t driveArmed = 0;
+
+void updateDriveLights()
+{
+    driveLights = 0;
+    for (uint8_t lightNr = 0; lightNr < numberOfLights; lightNr++)
+        if (cvsCache[CV106Light0KickTime + lightNr * 10] != 0 || cvsCache[CV108Light0MaxOnTime + lightNr * 10] != 0)
+            driveLights |= 1 << lightNr;
+    // Forget the lights no longer driven, so that they start with a kick if driven again
+    driveLightsOn &= driveLights;
+    driveArmed &= driveLights;
+}
+
+// Confirmation filter (CV46, CV47): count N and window M as a mask of the M last packets
+uint8_t confirmCount = 1;
+uint8_t confirmWindowMask = 0x01;
+
+void updateConfirmFilter()
+{
+    confirmCount = cvsCache[CV46ConfirmCount];
+    if (confirmCount < 1 || confirmCount > 8)
+        confirmCount = 1;
+    uint8_t window = cvsCache[CV47ConfirmWindow];
+    if (window < confirmCount || window > 8)
+        window = confirmCount;
+    confirmWindowMask = (uint8_t)((1 << window) - 1);
+}
+
+// decoderLocked is true when CV writes are rejected by the decoder lock (CV15, CV16)
+// It is computed when one of these CVs changes, so that the check of every CV write is a single test
+bool decoderLocked = false;
+
+void updateDecoderLock()
+{
+    decoderLocked = cvsCache[CV16DecoderLockId] != 0 && cvsCache[CV15DecoderLock] != cvsCache[CV16DecoderLockId];
+}
+
+// listenAddresses[] holds our address and the second address, computed when one of their CVs changes
+// NmraDcc passes the packets of our address only (FLAGS_MY_ADDRESS_ONLY), so that it never applies the CV writes
+// on the main track of other locos. The speed and functions of the second address are decoded by notifyDccMsg()
+// and passed to the same callbacks, which find the index of the address with getAddressIndex()
+const uint16_t noAddress = 0xFFFF; // Matches no packet
+uint16_t listenAddresses[numberOfAddresses];
+
+void updateListenAddresses()
+{
+    if (cvsCache[CV29ModeControl] & 0x20)
+        listenAddresses[0] = (uint16_t)(cvsCache[CV17ExtendedAddressMSB] & 0x3F) << 8 | cvsCache[CV18ExtendedAddressLSB];
+    else
+        listenAddresses[0] = cvsCache[CV1PrimaryAddress];
+    listenAddresses[1] = (uint16_t)cvsCache[CV43SecondAddressMSB] << 8 | cvsCache[CV42SecondAddressLSB];
+    if (listenAddresses[1] == 0)
+        listenAddresses[1] = noAddress;
+}
+
+// Return the index of the address (0: our address, 1: second address) matching Addr, or -1 if none does
+inline int8_t getAddressIndex(uint16_t Addr)
+{
+    if (Addr == listenAddresses[0])
+        return (0);
+    if (Addr == listenAddresses[1])
+        return (1);
+    return (-1);
+}
+
+// This callback function is called when a CV Value changes so we can update cvsCache[]
+void notifyCVChange(uint16_t CV, uint8_t Value)
+{
+#ifdef DEBUG
+    Serial.print("notifyCVChange: CV: ");
+    Serial.print(CV);
+    Serial.print(" Value: ");
+    Serial.println(Value);
+#endif
+
+    recordEvent(EventCVChange, (uint8_t)CV);
+    if (CV < numberOfCvsInCache)
+    {
+        cvsCache[CV] = Value;
+        updateDecoderLock();
+        updateListenAddresses();
+        updateLightParams();
+        updateLightBrightness();
+        updateBinaryStatesUsed();
+        updatePowerBudget();
+        updateDriveLights();
+        updateConfirmFilter();
+        updateLightRouting();
+    }
+}
+
+// This callback function is called by the NmraDcc library to check if a CV number is valid
+// It replaces the check of NmraDcc, so CV7 and CV8 are made read only here too
+// Writes to a locked decoder are rejected here, before they reach the EEPROM and cvsCache[]
+// The reset counters, the light usage and the flight recorder can be read but not written
+uint8_t notifyCVValid(uint16_t CV, uint8_t Writable)
+{
+    if (CV > E2END)
+        return (0);
+    if (Writable && decoderLocked && CV != CV15DecoderLock)
+        return (0);
+    if (Writable && (CV == CV7ManufacturerVersionNumber || CV == CV8ManufacturerIDNumber ||
+                     (CV >= resetCountersEepromAddress && CV < resetCountersEepromAddress + numberOfResetCounters) ||
+                     (CV >= lightUsageEepromAddress && CV < lightUsageEepromAddress + numberOfLightUsageSlots * sizeof(LightUsageRecord)) ||
+                     (CV >= flightRecorderEepromAddress && CV < flightRecorderEepromAddress + 2 + flightRecorderSize * sizeof(FlightRecorderEntry))))
+        return (0);
+    return (1);
+}
+
+// This callback function is called by the NmraDcc library to read a CV, in service mode and in ops mode
+// The CVs in cvsCache[] (kept up to date by notifyCVChange()), the operating hours and energy of lights and the
+// interrupt histograms (ISR_PROFILE) are served from RAM, the other CVs from the EEPROM
+uint8_t notifyCVRead(uint16_t CV)
+{
+    if (CV < numberOfCvsInCache)
+        return (cvsCache[CV]);
+    if (CV >= lightUsageEepromAddress && CV < lightUsageEepromAddress + numberOfLights * lightUsageCVs)
+    {
+        uint8_t index = CV - lightUsageEepromAddress;
+        LightUsage usage = lightUsage.lights[index / lightUsageCVs]; // Copied: no pointer into the packed record
+        uint16_t value = (index % lightUsageCVs < 2) ? usage.onTime : usage.energy;
+        return ((index % 2) ? value >> 8 : value & 0xFF);
+    }
+#ifdef ISR_PROFILE
+    if (CV >= isrHistogramsCV && CV < isrHistogramsCV + 2 * 2 * isrHistogramBins)
+        return (readIsrHistogramCV(CV));
+#endif
+    return (EEPROM.read(CV));
+}
+
+// This callback function is called when the CVs must be reset to their factory defaults
+// Make FactoryDefaultCVIndex non-zero and equal to the number of CVs to be reset
+// to flag to the loop() function that a reset to factory defaults needs to be done
+void notifyCVResetFactoryDefault()
+{
+#ifdef DEBUG
+    Serial.println("notifyCVResetFactoryDefault");
+#endif
+    // NmraDcc calls this function on a write to CV8 before checking the write with notifyCVValid()
+    if (decoderLocked)
+        return;
+    recordEvent(EventFactoryReset, 0);
+    FactoryDefaultCVIndex = sizeof(FactoryDefaultCVs) / sizeof(CVPair);
+    factoryResetLastProgress = millis();
+};
+
+// Function called at setup time to load all CVs to the array cvsCache[] in memory
+// All CVs up to the highest one used are read, so that notifyCVRead() can serve any of them from cvsCache[]
+// The EEPROM is read directly, as Dcc.getCV() calls notifyCVRead()
+void readCvsToCache()
+{
+    for (uint8_t cvNr = 0; cvNr < numberOfCvsInCache; cvNr++)
+    {
+        cvsCache[cvNr] = EEPROM.read(cvNr);
+#ifdef DEBUG
+        Serial.print("CV");
+        Serial.print(cvNr);
+        Serial.print("=");
+        Serial.print(cvsCache[cvNr]);
+        Serial.print("|");
+#endif
+    }
+#ifdef DEBUG
+    Serial.println();
+#endif
+}
+
+// Version 1.3 had CV1, CV7, CV8, CV29 and CV50 to CV54 of each light only
+bool isVersion13CV(uint16_t CV)
+{
+    return (CV == CV1PrimaryAddress || CV == CV7ManufacturerVersionNumber || CV == CV8ManufacturerIDNumber ||
+            CV == CV29ModeControl || (CV >= CV50Light0Brightness && CV <= CV94Light4Effect && CV % 10 < 5));
+}
+
+// Called at boot, after readCvsToCache() and before Dcc.init() writes versionId to CV7
+// The EEPROM is kept when the firmware is upgraded, so the CVs added since the version in CV7 read 0xFF
+// (e.g. CV56 = 255 would gate the lights on a binary state never set): set them to their factory default
+// An erased EEPROM (CV7 = 0xFF) is left to the automatic factory reset of NmraDcc
+void upgradeCVs()
+{
+    uint8_t previousVersion = cvsCache[CV7ManufacturerVersionNumber];
+    if (previousVersion == 0xFF || previousVersion >= versionId)
+        return;
+    for (uint8_t i = 0; i < sizeof(FactoryDefaultCVs) / sizeof(CVPair); i++)
+    {
+        uint16_t CV = FactoryDefaultCVs[i].CV;
+        if (CV < numberOfCvsInCache && !isVersion13CV(CV)) // A product default outside the cache is not a CV
+        {
+            EEPROM.write(CV, FactoryDefaultCVs[i].Value);
+            cvsCache[CV] = FactoryDefaultCVs[i].Value;
+        }
+    }
+}
+
+// Timers of lights (CV100 to CV103 for Light0)
+struct LightTimers
+{
+    uint8_t onDelay;
+    uint8_t offDelay;
+    uint8_t oneShotDuration;
+    uint8_t oneShotMode;
+};
+
+enum LightTimerPhase : uint8_t
+{
+    TimerIdle,
+    TimerOnDelay,
+    TimerOneShot,
+    TimerOffDelay
+};
+
+// Timers count down in ticks, and only while armed (bit set in lightTimersArmed)
+// Lights without an armed timer cost nothing in processTick()
+const uint8_t lightTimerTicksPerUnit = 2; // CV100 to CV102 are in 0.2 s
+uint8_t lightTimersArmed = 0;
+uint16_t lightTimerCount[numberOfLights];
+LightTimerPhase lightTimerPhase[numberOfLights];
+
+// lightConditions has the bits of the lights whose conditions (function, direction, speed, binary state) are met
+uint8_t lightConditions = 0;
+
+inline const LightTimers *getLightTimers(uint8_t lightNr)
+{
+    return ((const LightTimers *)&cvsCache[CV100Light0OnDelay + lightNr * 10]);
+}
+
+void startLightTimer(uint8_t lightNr, LightTimerPhase phase, uint8_t duration)
+{
+    lightTimerPhase[lightNr] = phase;
+    lightTimerCount[lightNr] = duration * lightTimerTicksPerUnit;
+    lightTimersArmed |= 1 << lightNr;
+}
+
+void stopLightTimer(uint8_t lightNr)
+{
+    lightTimerPhase[lightNr] = TimerIdle;
+    lightTimersArmed &= ~(1 << lightNr);
+}
+
+void turnLightOn(uint8_t lightNr)
+{
+    setLightOn(lightNr, true);
+    if (getLightTimers(lightNr)->oneShotDuration != 0)
+        startLightTimer(lightNr, TimerOneShot, getLightTimers(lightNr)->oneShotDuration);
+    else
+        stopLightTimer(lightNr);
+}
+
+// Called when the conditions of a light become met or no longer met
+void lightConditionsChanged(uint8_t lightNr, bool met)
+{
+    const LightTimers *timers = getLightTimers(lightNr);
+    if (met)
+    {
+        if (lightTimerPhase[lightNr] == TimerOneShot && timers->oneShotMode == 0)
+            return;
+        if (timers->onDelay != 0 && !isLightOn(lightNr))
+            startLightTimer(lightNr, TimerOnDelay, timers->onDelay);
+        else
+            turnLightOn(lightNr);
+    }
+    else
+    {
+        if (lightTimerPhase[lightNr] == TimerOneShot)
+            return;
+        if (isLightOn(lightNr) && timers->offDelay != 0)
+            startLightTimer(lightNr, TimerOffDelay, timers->offDelay);
+        else
+        {
+            stopLightTimer(lightNr);
+            setLightOn(lightNr, false);
+        }
+    }
+}
+
+// Called every tick: count down the armed timers
+void updateLightTimers()
+{
+    if (lightTimersArmed == 0)
+        return;
+    for (uint8_t lightNr = 0; lightNr < numberOfLights; lightNr++)
+    {
+        if ((lightTimersArmed & (1 << lightNr)) && --lightTimerCount[lightNr] == 0)
+        {
+            if (lightTimerPhase[lightNr] == TimerOnDelay)
+                turnLightOn(lightNr);
+            else
+            {
+                stopLightTimer(lightNr);
+                setLightOn(lightNr, false);
+            }
+        }
+    }
+}
+
+// Compute the conditions of the lights, and store in LIGHT_FLAGS the state (ON/OFF) of the lights
+// (the state changes immediately or through the timers of the light)
+// To be called whenever one of the underlying parameters (CVs, Fcts, speed, direction) changes
+void updateLightCache()
+{
+#ifdef DEBUG
+    Serial.print("updateLightCache: ");
+#endif
+    for (uint8_t lightNr = 0; lightNr < numberOfLights; lightNr++)
+    {
+        const LightParams *params = lightParams[lightNr];
+        uint8_t flags = getAddressFlags(cvsCache[CV59Light0Address + lightNr * 10] ? 1 : 0);
+        // A function number higher than F4 is handled as 31 (None)
+        uint8_t controlFunction = params->controlFunction;
+        if (controlFunction > (numberOfFcts - 1))
+            controlFunction = 31;
+        bool met =
+            (bool)((controlFunction == 31 || (flags & (1 << controlFunction))) &&
+                   (params->directionSensitivity == 0 || (params->directionSensitivity == 1 && (flags & flagForward)) || (params->directionSensitivity == 2 && !(flags & flagForward))) &&
+                   (params->speedSensitivity == 0 || (params->speedSensitivity == 1 && (flags & flagMoving))) &&
+                   (params->binaryState == 0 || getBinaryState(binaryStates, params->binaryState)));
+        if (met != (bool)(lightConditions & (1 << lightNr)))
+        {
+            lightConditions ^= 1 << lightNr;
+            lightConditionsChanged(lightNr, met);
+        }
+#ifdef DEBUG
+        Serial.print(lightNr);
+        Serial.print("=");
+        Serial.print(isLightOn(lightNr));
+        Serial.print("|");
+#endif
+    }
+#ifdef DEBUG
+    Serial.println();
+#endif
+}
+
+// effectClock is the time base (in ms) of light effects. It runs from millis() but is reset by the effect
+// synchronization (CV36, CV37) so that all decoders flash in phase
+// The drift of millis() against the synchronization interval (CV38) is corrected by adding or skipping
+// one ms every effectDriftStep ms, which keeps the decoders in phase between synchronizations
+uint32_t effectClock = 0;
+uint32_t effectClockLastMillis = 0;
+uint32_t effectSyncLastMillis = 0;
+uint32_t effectDriftStep = 0;
+uint32_t effectDriftCounter = 0;
+int8_t effectDriftDirection = 0; // +1: add one ms, -1: skip one ms, 0: no correction
+
+// Each light runs its effect from its own clock (in 1/64 ms), advancing at lightEffectRate[] / 64 times the
+// speed of effectClock. The rate is set by the analog function group packets (see CV104 and CV105)
+const uint8_t effectRateNominal = 64;
+uint8_t lightEffectRate[numberOfLights] = {effectRateNominal, effectRateNominal, effectRateNominal, effectRateNominal, effectRateNominal};
+uint32_t lightEffectClock[numberOfLights];
+
+// To be called once per loop, before computing the value of light outputs
+void updateEffectClock()
+{
+    uint32_t timeNow = millis();
+    uint32_t elapsed = timeNow - effectClockLastMillis;
+    effectClockLastMillis = timeNow;
+    if (effectDriftDirection != 0)
+    {
+        // All the corrections due, as a loop pass may have stalled for several steps
+        // A ms to skip when none elapsed stays in the counter for the next pass
+        effectDriftCounter += elapsed;
+        while (effectDriftCounter >= effectDriftStep && (effectDriftDirection > 0 || elapsed > 0))
+        {
+            effectDriftCounter -= effectDriftStep;
+            elapsed += effectDriftDirection;
+        }
+    }
+    effectClock += elapsed;
+    for (uint8_t lightNr = 0; lightNr < numberOfLights; lightNr++)
+        lightEffectClock[lightNr] += elapsed * lightEffectRate[lightNr];
+}
+
+// Called when an effect synchronization is received
+void syncEffectClock()
+{
+    uint32_t timeNow = millis();
+    uint32_t localInterval = timeNow - effectSyncLastMillis;
+    uint32_t nominalInterval = (uint32_t)cvsCache[CV38EffectSyncPeriod] * 1000;
+    effectSyncLastMillis = timeNow;
+
+    // Measure the drift only if the synchronization interval is within 10% of the nominal one
+    // (a missed or an extra synchronization gives a meaningless measure)
+    if (nominalInterval != 0 && localInterval > nominalInterval - nominalInterval / 10 &&
+        localInterval < nominalInterval + nominalInterval / 10)
+    {
+        uint32_t drift = (localInterval > nominalInterval) ? localInterval - nominalInterval : nominalInterval - localInterval;
+        effectDriftDirection = (drift == 0) ? 0 : (localInterval > nominalInterval) ? -1 : 1;
+        if (drift != 0)
+            effectDriftStep = localInterval / drift;
+    }
+
+#ifdef DEBUG
+    Serial.print("syncEffectClock: interval=");
+    Serial.print(localInterval);
+    Serial.print("|step=");
+    Serial.println(effectDriftDirection * (int32_t)effectDriftStep);
+#endif
+    effectClock = 0;
+    for (uint8_t lightNr = 0; lightNr < numberOfLights; lightNr++)
+        lightEffectClock[lightNr] = 0;
+    effectClockLastMillis = timeNow;
+    effectDriftCounter = 0;
+}
+
+// Get the state of function fctNr (0..28) from a function packet
+// Return false if the packet is for another function group
+bool getFunctionState(uint8_t fctNr, FN_GROUP FuncGrp, uint8_t FuncState, bool *state)
+{
+    FN_GROUP fctGrp;
+    uint8_t fctBit;
+    if (fctNr == 0)
+    {
+        fctGrp = FN_0_4;
+        fctBit = FN_BIT_00;
+    }
+    else if (fctNr <= 4)
+    {
+        fctGrp = FN_0_4;
+        fctBit = 1 << (fctNr - 1);
+    }
+    else if (fctNr <= 8)
+    {
+        fctGrp = FN_5_8;
+        fctBit = 1 << (fctNr - 5);
+    }
+    else if (fctNr <= 12)
+    {
+        fctGrp = FN_9_12;
+        fctBit = 1 << (fctNr - 9);
+    }
+    else if (fctNr <= 20)
+    {
+        fctGrp = FN_13_20;
+        fctBit = 1 << (fctNr - 13);
+    }
+    else if (fctNr <= 28)
+    {
+        fctGrp = FN_21_28;
+        fctBit = 1 << (fctNr - 21);
+    }
+    else
+        return (false);
+
+    if (FuncGrp != fctGrp)
+        return (false);
+    *state = FuncState & fctBit;
+    return (true);
+}
+
+// Enter or leave the tuning mode with the function CV41
+// Leaving the tuning mode commits the brightness tuned with a single CV write
+// Entering it is refused for a light taking its brightness from a stock profile, as its CVs are not used
+void checkTuningFunction(FN_GROUP FuncGrp, uint8_t FuncState)
+{
+    bool state;
+    uint8_t lightNr = cvsCache[CV40TuningLight] - 1;
+    if (lightNr >= numberOfLights || !getFunctionState(cvsCache[CV41TuningFunction], FuncGrp, FuncState, &state) || state == tuningActive)
+        return;
+    const LightParams *params = (const LightParams *)&cvsCache[CV50Light0Brightness + lightNr * 10];
+    if (state && lightBrightnessParams(lightNr) != params)
+        return;
+
+#ifdef DEBUG
+    Serial.print("Tuning mode: ");
+    Serial.println(state);
+#endif
+    if (state)
+        tuningBrightness = (nightMode && cvsCache[CV30DayNightMode] != 0) ? params->nightBrightness : params->brightness;
+    else
+        Dcc.setCV(((nightMode && cvsCache[CV30DayNightMode] != 0) ? CV55Light0NightBrightness : CV50Light0Brightness) + lightNr * 10, tuningBrightness);
+    tuningActive = state;
+    updateLightBrightness();
+}
+
+// In tuning mode, the speed knob sets the brightness of the light tuned, from 0 (stop) to 255 (full speed)
+void setTuningBrightness(uint8_t Speed, DCC_SPEED_STEPS SpeedSteps)
+{
+    uint8_t brightness = (Speed > 1) ? (uint16_t)(Speed - 1) * 255 / (SpeedSteps - 1) : 0;
+    if (brightness != tuningBrightness)
+    {
+        tuningBrightness = brightness;
+        updateLightBrightness();
+    }
+}
+
+// Speed values passed by NmraDcc to notifyDccSpeed()
+const uint8_t speedStop = 0;
+const uint8_t speedEmergencyStop = 1;
+
+// emergencyStopLights has the bits of the lights driven by the emergency stop reaction (CV34, CV35) while it is active
+// It is 0 otherwise, so that valueLight() pays a single test for it
+uint8_t emergencyStopLights = 0;
+
+void updateLightOutputs();
+
+// Confirmation filter history of one field (speed and direction, or functions F0 to F4) of an address
+// A value other than the current one becomes the candidate once the previous candidate has left the window,
+// so that a corrupted packet between two packets with the new value does not restart the count
+struct ConfirmHistory
+{
+    uint16_t candidate;
+    uint8_t received; // Bit i set when the packet i packets ago carried the candidate
+};
+ConfirmHistory speedHistory[numberOfAddresses];
+ConfirmHistory functionHistory[numberOfAddresses];
+
+// To be called for every packet of the field. Return true when value is the current value or is confirmed
+inline bool confirmValue(ConfirmHistory *history, uint16_t value, uint16_t current)
+{
+    if (confirmCount == 1)
+        return (true);
+    history->received <<= 1;
+    if (value == current)
+        return (true);
+    if (value == history->candidate)
+        history->received |= 1;
+    else if ((history->received & confirmWindowMask) == 0)
+    {
+        history->candidate = value;
+        history->received = 1;
+    }
+    return (value == history->candidate && __builtin_popcount(history->received & confirmWindowMask) >= confirmCount);
+}
+
+// This callback function is called whenever we receive a DCC speed packet
+void notifyDccSpeed(uint16_t Addr, DCC_ADDR_TYPE AddrType, uint8_t Speed, DCC_DIRECTION Dir, DCC_SPEED_STEPS SpeedSteps)
+{
+    // Keep only the packets for our addresses and the broadcast packets
+    int8_t addrIdx = getAddressIndex(Addr);
+    if (addrIdx < 0 && Addr != 0)
+        return;
+
+    // Fast path for broadcast stops and emergency stops
+    // The reaction is applied to the light outputs right away, from within the processing of this packet
+    if (Speed == speedEmergencyStop || (Addr == 0 && Speed == speedStop))
+    {
+#ifdef DEBUG
+        Serial.println("notifyDccSpeed: Emergency stop");
+#endif
+        recordEvent(EventEmergencyStop, 0);
+        for (uint8_t i = 0; i < numberOfAddresses; i++)
+        {
+            if (Addr == 0 || i == addrIdx)
+            {
+                locoState[i].speed = speedStop;
+                setAddressFlag(i, flagMoving, false);
+            }
+        }
+        if (cvsCache[CV34EmergencyStopReaction] != 0)
+            emergencyStopLights = cvsCache[CV35EmergencyStopLights];
+        updateLightCache();
+        updateLightOutputs();
+        return;
+    }
+
+    // Broadcast packets do not change the direction of the loco
+    if (Addr == 0)
+        return;
+
+    LocoState *state = &locoState[addrIdx];
+    bool forward = (Dir == DCC_DIR_FWD);
+    uint16_t speedValue = Speed | (forward ? 0x80 : 0) | (uint16_t)SpeedSteps << 8;
+    uint16_t speedCurrent = state->speed | (testAddressFlag(addrIdx, flagForward) ? 0x80 : 0) | (uint16_t)state->speedSteps << 8;
+    if (!confirmValue(&speedHistory[addrIdx], speedValue, speedCurrent))
+        return;
+
+    // The emergency stop reaction lasts until the loco is driven again
+    if (Speed > speedEmergencyStop)
+        emergencyStopLights = 0;
+
+    if (tuningActive && addrIdx == 0)
+        setTuningBrightness(Speed, SpeedSteps);
+
+    if (speedValue != speedCurrent)
+    {
+#ifdef DEBUG
+        Serial.print("notifyDccSpeed: Speed=");
+        Serial.print(Speed, DEC);
+        Serial.print("|Steps=");
+        Serial.print(SpeedSteps, DEC);
+        Serial.print("|Dir=");
+        Serial.println((Dir == DCC_DIR_FWD) ? "Fwd" : "Rev");
+#endif
+
+        recordEvent(EventSpeed, Speed | (Dir == DCC_DIR_FWD ? 0x80 : 0));
+        state->speed = Speed;
+        state->speedSteps = SpeedSteps;
+        setAddressFlag(addrIdx, flagForward, forward);
+        setAddressFlag(addrIdx, flagMoving, Speed > 1);
+        updateLightCache();
+    }
+};
+
+// Trigger the effect synchronization when the function CV37 is turned on
+bool effectSyncFctState = false;
+
+void checkEffectSyncFunction(FN_GROUP FuncGrp, uint8_t FuncState)
+{
+    bool state;
+    if (getFunctionState(cvsCache[CV37EffectSyncFunction], FuncGrp, FuncState, &state))
+    {
+        if (state && !effectSyncFctState)
+            syncEffectClock();
+        effectSyncFctState = state;
+    }
+}
+
+// Store the state of functions F0 to F4 of an address in its loco state and its flags
+void setFunctionFlags(uint8_t addrIdx, uint8_t FuncState)
+{
+    locoState[addrIdx].funcState = FuncState;
+    setAddressFunctions(addrIdx, FuncState);
+}
+
+// This callback function is called whenever we receive a DCC Function packet
+void notifyDccFunc(uint16_t Addr, DCC_ADDR_TYPE AddrType, FN_GROUP FuncGrp, uint8_t FuncState)
+{
+    // Effect synchronization from a broadcast function packet
+    if (Addr == 0 && cvsCache[CV37EffectSyncFunction] <= 28)
+        checkEffectSyncFunction(FuncGrp, FuncState);
+
+    // Keep only the packets for our addresses. Broadcast packets apply to our address
+    int8_t addrIdx = (Addr == 0) ? 0 : getAddressIndex(Addr);
+    if (addrIdx < 0)
+        return;
+
+    // Tuning mode
+    if (Addr != 0 && addrIdx == 0 && cvsCache[CV40TuningLight] != 0)
+        checkTuningFunction(FuncGrp, FuncState);
+
+    // Check that the DCC packet is for functions 0 to 4 (the only functions we use)
+    // Check that one of the functions has changed, and that the change is confirmed
+    if (FuncGrp == FN_0_4 && confirmValue(&functionHistory[addrIdx], FuncState, locoState[addrIdx].funcState) && locoState[addrIdx].funcState != FuncState)
+    {
+#ifdef DEBUG
+        Serial.print("Function Group: ");
+        Serial.print(FuncGrp);
+        Serial.print("|State = 0b");
+        Serial.println(FuncState, BIN);
+#endif
+        recordEvent(EventFunction, FuncState);
+        setFunctionFlags(addrIdx, FuncState);
+        updateLightCache();
+        if (addrIdx == 0)
+        {
+            recordEvent(EventEepromWrite, fctsEepromAddress);
+            EEPROM.write(fctsEepromAddress, FuncState);
+        }
+    }
+}
+
+// DCC instructions decoded in notifyDccMsg()
+const uint8_t dccInstrBinaryStateLong = 0xC0;  // 11000000 DLLLLLLL HHHHHHHH
+const uint8_t dccInstrModelTime = 0xC1;        // 11000001 00MMMMMM WWWHHHHH U0BBBBBB (broadcast only)
+const uint8_t dccInstrBinaryStateShort = 0xDD; // 11011101 DLLLLLLL
+const uint8_t dccInstrAnalogFunction = 0x3D;   // 00111101 VVVVVVVV DDDDDDDD (channel, value)
+const uint8_t dccInstrSpeed128 = 0x3F;         // 00111111 DSSSSSSS (second address only)
+const uint8_t dccInstrSpeed28 = 0x40;          // 01DCSSSS (second address only, mask 0xC0)
+const uint8_t dccInstrFunctions0To4 = 0x80;    // 100DDDDD (second address only, mask 0xE0)
+
+// Return the index of the instruction byte of a multi function decoder packet
+// for one of our addresses or for the broadcast address. Return 0 for any other packet
+// *addrIdx is set to the index of the address (see getAddressIndex()), or -1 for the broadcast address
+uint8_t dccMsgInstructionIndex(DCC_MSG *Msg, int8_t *addrIdx)
+{
+    uint8_t addrByte = Msg->Data[0];
+    *addrIdx = -1;
+    if (addrByte == 0)
+        return (1);
+    if (addrByte < 128)
+        *addrIdx = getAddressIndex(addrByte);
+    else if (addrByte >= 0xC0 && addrByte <= 0xE7 && Msg->Size > 3)
+        *addrIdx = getAddressIndex((uint16_t)(addrByte & 0x3F) << 8 | Msg->Data[1]);
+    if (*addrIdx < 0)
+        return (0);
+    return ((addrByte < 128) ? 1 : 2);
+}
+
+// Decode a binary state control packet (short or long form) starting at instruction index i
+// Return false if the packet is not a binary state control packet
+bool decodeBinaryState(DCC_MSG *Msg, uint8_t i, uint16_t *number, bool *state)
+{
+    // Msg->Size includes the error detection byte
+    if (Msg->Data[i] == dccInstrBinaryStateShort && Msg->Size >= i + 3)
+        *number = Msg->Data[i + 1] & 0x7F;
+    else if (Msg->Data[i] == dccInstrBinaryStateLong && Msg->Size >= i + 4)
+        *number = (uint16_t)Msg->Data[i + 2] << 7 | (Msg->Data[i + 1] & 0x7F);
+    else
+        return (false);
+    *state = Msg->Data[i + 1] & 0x80;
+    return (true);
+}
+
+// Night is from CV31NightStartHour (included) to CV32DayStartHour (excluded)
+bool isNightHour(uint8_t hour)
+{
+    if (cvsCache[CV31NightStartHour] > cvsCache[CV32DayStartHour])
+        return (hour >= cvsCache[CV31NightStartHour] || hour < cvsCache[CV32DayStartHour]);
+    else
+        return (hour >= cvsCache[CV31NightStartHour] && hour < cvsCache[CV32DayStartHour]);
+}
+
+// Apply an analog function group packet to the lights controlled by this channel (see CV104 and CV105)
+// addrIdx is the index of the address of the packet, or -1 for the broadcast address
+// Command stations repeat these packets, so only a change of value costs a brightness update
+void setAnalogFunction(int8_t addrIdx, uint8_t channel, uint8_t value)
+{
+    bool brightnessChanged = false;
+    for (uint8_t lightNr = 0; lightNr < numberOfLights; lightNr++)
+    {
+        if (channel == 0 || cvsCache[CV104Light0AnalogChannel + lightNr * 10] != channel)
+            continue;
+        if (addrIdx >= 0 && (cvsCache[CV59Light0Address + lightNr * 10] ? 1 : 0) != addrIdx)
+            continue;
+        if (cvsCache[CV105Light0AnalogMode + lightNr * 10] == 0)
+        {
+            if (analogLevel[lightNr] != value)
+            {
+                analogLevel[lightNr] = value;
+                brightnessChanged = true;
+            }
+        }
+        else
+            lightEffectRate[lightNr] = value;
+    }
+    if (brightnessChanged)
+    {
+#ifdef DEBUG
+        Serial.print("Analog channel ");
+        Serial.print(channel);
+        Serial.print("=");
+        Serial.println(value);
+#endif
+        updateLightBrightness();
+    }
+}
+
+// Pass the speed and function packets of the second address to notifyDccSpeed() and notifyDccFunc(), decoded as
+// NmraDcc does for our address. The speed and direction instruction is taken as 28 speed steps
+void processSecondAddress(DCC_MSG *Msg, uint8_t i)
+{
+    uint8_t instruction = Msg->Data[i];
+    DCC_ADDR_TYPE addrType = (Msg->Data[0] < 128) ? DCC_ADDR_SHORT : DCC_ADDR_LONG;
+    if (instruction == dccInstrSpeed128 && Msg->Size >= i + 3)
+        notifyDccSpeed(listenAddresses[1], addrType, Msg->Data[i + 1] & 0x7F, (Msg->Data[i + 1] & 0x80) ? DCC_DIR_FWD : DCC_DIR_REV, SPEED_STEP_128);
+    else if ((instruction & 0xC0) == dccInstrSpeed28)
+    {
+        // Steps 0 and 1 stop, 2 and 3 emergency stop, then steps 1 to 28 passed as 2 to 29
+        uint8_t speed = (instruction & 0x0F) << 1 | (instruction & 0x10) >> 4;
+        speed = (speed < 2) ? speedStop : (speed < 4) ? speedEmergencyStop : speed - 2;
+        notifyDccSpeed(listenAddresses[1], addrType, speed, (instruction & 0x20) ? DCC_DIR_FWD : DCC_DIR_REV, SPEED_STEP_28);
+    }
+    else if ((instruction & 0xE0) == dccInstrFunctions0To4)
+        notifyDccFunc(listenAddresses[1], addrType, FN_0_4, instruction & 0x1F);
+}
+
+// This callback function is called by the NmraDcc library for every valid DCC packet received
+// It handles the packets not decoded by NmraDcc itself, and the packets of the second address
+void notifyDccMsg(DCC_MSG *Msg)
+{
+    int8_t addrIdx;
+    uint8_t i = dccMsgInstructionIndex(Msg, &addrIdx);
+    if (i == 0)
+        return;
+
+    uint16_t number;
+    bool state;
+    if (decodeBinaryState(Msg, i, &number, &state))
+    {
+        // Binary state 0 sets or clears all states. States above 255 are not supported
+        if (number == 0)
+        {
+            for (uint8_t j = 0; j < numberOfBinaryStateBytes; j++)
+                binaryStates[j] = state ? 0xFF : 0x00;
+        }
+        else if (number < 256 && getBinaryState(binaryStatesUsed, number) && getBinaryState(binaryStates, number) != state)
+            setBinaryState(binaryStates, number, state);
+        else
+            return;
+
+        recordEvent(EventBinaryState, number);
+#ifdef DEBUG
+        Serial.print("Binary state ");
+        Serial.print(number);
+        Serial.print("=");
+        Serial.println(state);
+#endif
+        updateLightCache();
+        if (state && number != 0 && number == cvsCache[CV36EffectSyncBinaryState])
+            syncEffectClock();
+        if (cvsCache[CV30DayNightMode] == 2 && cvsCache[CV33NightBinaryState] != 0)
+            setNightMode(getBinaryState(binaryStates, cvsCache[CV33NightBinaryState]));
+    }
+    else if (cvsCache[CV30DayNightMode] == 1 && Msg->Data[0] == 0 && Msg->Data[i] == dccInstrModelTime && Msg->Size >= 6 && (Msg->Data[2] & 0xC0) == 0)
+        setNightMode(isNightHour(Msg->Data[3] & 0x1F));
+    else if (Msg->Data[i] == dccInstrAnalogFunction && Msg->Size >= i + 4)
+        setAnalogFunction(addrIdx, Msg->Data[i + 1], Msg->Data[i + 2]);
+    else if (addrIdx == 1)
+        processSecondAddress(Msg, i);
+}
+
+void readFctsToCache()
+{
+    setFunctionFlags(0, EEPROM.read(fctsEepromAddress));
+}
+
+#ifdef SERIAL_CONFIG
+// Serial configuration port, see the description at the top of this file
+const uint32_t serialConfigWindow = 100; // Time (in ms) during which the sync string is accepted after power on
+const uint32_t serialConfigTimeout = 1000; // Time (in ms) without any byte received to leave the session
+const char serialConfigSync[] = "DCL";
+const uint16_t eepromImageSize = EEPROM_SIZE;
+
+// CRC-16/CCITT-FALSE, one byte at a time
+uint16_t crc16Update(uint16_t crc, uint8_t data)
+{
+    crc ^= (uint16_t)data << 8;
+    for (uint8_t bit = 0; bit < 8; bit++)
+        crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+    return (crc);
+}
+
+// Wait for one byte on the serial line. Returns -1 after serialConfigTimeout ms without data
+int16_t serialConfigRead()
+{
+    uint32_t timeStart = millis();
+    while (!Serial.available())
+        if (millis() - timeStart > serialConfigTimeout)
+            return (-1);
+    return (Serial.read());
+}
+
+// Receive a complete EEPROM image, check its CRC, then commit it page by page
+bool serialConfigWriteImage()
+{
+    uint8_t image[eepromImageSize];
+    uint16_t crc = 0xFFFF;
+    for (uint16_t i = 0; i < eepromImageSize; i++)
+    {
+        int16_t data = serialConfigRead();
+        if (data < 0)
+            return (false);
+        image[i] = (uint8_t)data;
+        crc = crc16Update(crc, image[i]);
+    }
+    int16_t crcLow = serialConfigRead();
+    int16_t crcHigh = serialConfigRead();
+    if (crcLow < 0 || crcHigh < 0 || crc != (uint16_t)(crcLow | crcHigh << 8))
+        return (false);
+
+    for (uint8_t pageNr = 0; pageNr < eepromImageSize / eepromPageSize; pageNr++)
+    {
+        eepromWriteBlock(pageNr * eepromPageSize, &image[pageNr * eepromPageSize], eepromPageSize);
+        Serial.write('.');
+    }
+
+    // Read back the EEPROM to check that the image was written correctly
+    crc = 0xFFFF;
+    for (uint16_t i = 0; i < eepromImageSize; i++)
+        crc = crc16Update(crc, EEPROM.read(i));
+    return (crc == (uint16_t)(crcLow | crcHigh << 8));
+}
+
+// Send the complete EEPROM image followed by its CRC
+void serialConfigReadImage()
+{
+    uint16_t crc = 0xFFFF;
+    for (uint16_t i = 0; i < eepromImageSize; i++)
+    {
+        uint8_t data = EEPROM.read(i);
+        Serial.write(data);
+        crc = crc16Update(crc, data);
+    }
+    Serial.write((uint8_t)crc);
+    Serial.write((uint8_t)(crc >> 8));
+}
+
+// Called at power on, before the DCC input is used
+// Wait serialConfigWindow ms for the sync string, then process commands until 'X' or a timeout
+void serialConfig()
+{
+    uint8_t syncIndex = 0;
+    uint32_t timeStart = millis();
+    while (serialConfigSync[syncIndex])
+    {
+        if (millis() - timeStart > serialConfigWindow)
+            return;
+        if (Serial.available())
+        {
+            char data = Serial.read();
+            if (data == serialConfigSync[syncIndex])
+                syncIndex++;
+            else
+                syncIndex = (data == serialConfigSync[0]) ? 1 : 0;
+        }
+    }
+
+    Serial.write('S');
+    Serial.write(versionId);
+    Serial.write((uint8_t)(eepromImageSize / eepromPageSize));
+
+    while (true)
+    {
+        int16_t command = serialConfigRead();
+        switch (command)
+        {
+        case 'W':
+            Serial.write(serialConfigWriteImage() ? 'K' : 'E');
+            break;
+
+        case 'R':
+            serialConfigReadImage();
+            Serial.write('K');
+            break;
+
+        case 'X':
+            Serial.write('K');
+            Serial.flush();
+            return;
+
+        case -1:
+            return;
+
+        case 'D':
+        case 'C':
+        case 'L':
+            // Sync strings sent by the host before it received 'S'
+            break;
+
+        default:
+            Serial.write('E');
+            break;
+        }
+    }
+}
+#endif
+
+// Period (in ms) of light flash
+const uint32_t strobeFlashPeriod = 150;
+const uint32_t rotatingFlashPeriod = 600;
+const uint32_t hazardFlashPeriod = 1000;
+
+// Gamma table
+const uint8_t gamma[] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 2, 2, 2, 2, 2, 2, 2,
+    2, 3, 3, 3, 3, 3, 3, 3, 4, 4, 4, 4, 4, 5, 5, 5,
+    5, 6, 6, 6, 6, 7, 7, 7, 7, 8, 8, 8, 9, 9, 9, 10,
+    10, 10, 11, 11, 11, 12, 12, 13, 13, 13, 14, 14, 15, 15, 16, 16,
+    17, 17, 18, 18, 19, 19, 20, 20, 21, 21, 22, 22, 23, 24, 24, 25,
+    25, 26, 27, 27, 28, 29, 29, 30, 31, 32, 32, 33, 34, 35, 35, 36,
+    37, 38, 39, 39, 40, 41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 50,
+    51, 52, 54, 55, 56, 57, 58, 59, 60, 61, 62, 63, 64, 66, 67, 68,
+    69, 70, 72, 73, 74, 75, 77, 78, 79, 81, 82, 83, 85, 86, 87, 89,
+    90, 92, 93, 95, 96, 98, 99, 101, 102, 104, 105, 107, 109, 110, 112, 114,
+    115, 117, 119, 120, 122, 124, 126, 127, 129, 131, 133, 135, 137, 138, 140, 142,
+    144, 146, 148, 150, 152, 154, 156, 158, 160, 162, 164, 167, 169, 171, 173, 175,
+    177, 180, 182, 184, 186, 189, 191, 193, 196, 198, 200, 203, 205, 208, 210, 213,
+    215, 218, 220, 223, 225, 228, 231, 233, 236, 239, 241, 244, 247, 249, 252, 255};
+
+uint8_t valueLight(uint8_t lightNr)
+{
+    uint32_t timeNow;
+    if (emergencyStopLights & (1 << lightNr))
+    {
+        switch (cvsCache[CV34EmergencyStopReaction])
+        {
+        case 1: // Hazard flash
+            if (effectClock % hazardFlashPeriod < (hazardFlashPeriod / 2))
+                return (gamma[lightBrightness[lightNr]]);
+            else
+                return (0);
+            break;
+
+        case 2: // On
+            return (gamma[lightBrightness[lightNr]]);
+            break;
+
+        default: // Off
+            return (0);
+            break;
+        }
+    }
+    else if (isLightOn(lightNr))
+    {
+        switch (lightParams[lightNr]->effect)
+        {
+        case 0: // Always on
+            return (gamma[lightBrightness[lightNr]]);
+            break;
+
+        case 1: // Strobe flash
+            timeNow = (lightEffectClock[lightNr] >> 6) % strobeFlashPeriod;
+            if (timeNow < (strobeFlashPeriod / 12))
+                return (gamma[lightBrightness[lightNr]]);
+            else
+                return (0);
+            break;
+
+        case 2: // Rotating flash
+            timeNow = (lightEffectClock[lightNr] >> 6) % rotatingFlashPeriod;
+            if (timeNow < (rotatingFlashPeriod / 2))
+                return (gamma[(uint8_t)((2 * lightBrightness[lightNr] * timeNow) / rotatingFlashPeriod)]);
+            else
+                return (gamma[(uint8_t)((2 * lightBrightness[lightNr] * (rotatingFlashPeriod - timeNow)) / rotatingFlashPeriod)]);
+            break;
+        }
+    }
+    else
+        return (0);
+}
+
+// Reciprocal table for the power budget: reciprocal[i] = 65535 / ((i + 1) * 8)
+// Index with (totalDuty - 1) >> 3, which rounds the total duty up, so the scaled duties never exceed the budget
+const uint16_t reciprocal[] = {
+    8191, 4095, 2730, 2047, 1638, 1365, 1170, 1023, 910, 819, 744, 682, 630, 585, 546, 511,
+    481, 455, 431, 409, 390, 372, 356, 341, 327, 315, 303, 292, 282, 273, 264, 255,
+    248, 240, 234, 227, 221, 215, 210, 204, 199, 195, 190, 186, 182, 178, 174, 170,
+    167, 163, 160, 157, 154, 151, 148, 146, 143, 141, 138, 136, 134, 132, 130, 127,
+    126, 124, 122, 120, 118, 117, 115, 113, 112, 110, 109, 107, 106, 105, 103, 102,
+    101, 99, 98, 97, 96, 95, 94, 93, 92, 91, 90, 89, 88, 87, 86, 85,
+    84, 83, 82, 81, 81, 80, 79, 78, 78, 77, 76, 75, 75, 74, 73, 73,
+    72, 71, 71, 70, 70, 69, 68, 68, 67, 67, 66, 66, 65, 65, 64, 63,
+    63, 63, 62, 62, 61, 61, 60, 60, 59, 59, 58, 58, 58, 57, 57, 56,
+    56, 56, 55, 55, 54, 54, 54, 53, 53, 53, 52, 52, 52, 51, 51, 51};
+// Scale factor (in 1/256) bringing a total duty (1..1275) down to a budget lower than it, without division
+uint16_t powerScale(uint16_t budget, uint16_t totalDuty)
+{
+    return ((uint16_t)(((uint32_t)budget * reciprocal[(totalDuty - 1) >> 3]) >> 8));
+}
+
+// Staggered power up, see CV44 and CV45
+// powerUpScale (in 1/256) scales the duty of all lights until the power up is complete
+uint32_t powerUpStart = 0;
+uint32_t powerUpDelay = 0; // ms
+uint32_t powerUpRamp = 0;  // ms
+uint16_t powerUpScale = 256;
+
+// Called at boot, after the detection of a new decoder by Dcc.init() (factory reset pending)
+void initPowerUp(uint8_t resetFlags)
+{
+    // Only the power on resets are shared by all the decoders of the layout
+    if (!(resetFlags & RSTCTRL_PORF_bm) || FactoryDefaultCVIndex != 0)
+    {
+        powerUpScale = 256;
+        return;
+    }
+
+    // Hash the serial number of the chip (unique) and our address, then mix with a xorshift so that
+    // every byte changes the high bits used to pick the delay
+    const register8_t *serialNumber = &SIGROW.SERNUM0;
+    uint16_t hash = listenAddresses[0];
+    for (uint8_t i = 0; i < 10; i++)
+        hash = hash * 31 + serialNumber[i];
+    hash ^= hash << 7;
+    hash ^= hash >> 9;
+    hash ^= hash << 8;
+
+    powerUpStart = millis();
+    powerUpDelay = ((uint32_t)hash * cvsCache[CV44PowerUpDelay] * 100) >> 16;
+    powerUpRamp = (uint32_t)cvsCache[CV45PowerUpRamp] * 100;
+    powerUpScale = (powerUpDelay == 0 && powerUpRamp == 0) ? 256 : 0;
+#ifdef DEBUG
+    Serial.print("Power up delay ");
+    Serial.println(powerUpDelay);
+#endif
+}
+
+// To be called once per loop until powerUpScale reaches 256
+void updatePowerUp()
+{
+    uint32_t elapsed = millis() - powerUpStart;
+    if (elapsed < powerUpDelay)
+        powerUpScale = 0;
+    else if (elapsed - powerUpDelay < powerUpRamp)
+        powerUpScale = ((elapsed - powerUpDelay) << 8) / powerUpRamp;
+    else
+        powerUpScale = 256;
+}
+
+// Kick-and-hold drive profiles, see CV106 to CV108
+// The phase of each driven output follows its light: Kick when it turns on, then Hold, then Cutoff after the
+// maximum on-time, and Idle when it turns off. Kick and Hold count down on their own 10 ms tick, and only
+// while armed (bit set in driveArmed). Outputs without a profile cost one test of driveLights per loop
+enum DrivePhase : uint8_t
+{
+    DriveIdle,
+    DriveKick,
+    DriveHold,
+    DriveCutoff
+};
+
+const uint32_t driveTickInterval = 10; // ms
+const uint8_t driveTicksPerSecond = 100;
+uint32_t driveTickLastMillis = 0;
+uint16_t driveCount[numberOfLights];
+DrivePhase drivePhase[numberOfLights];
+
+void startDrivePhase(uint8_t lightNr, DrivePhase phase, uint16_t ticks)
+{
+    // No kick: hold right away
+    if (phase == DriveKick && ticks == 0)
+    {
+        phase = DriveHold;
+        ticks = cvsCache[CV108Light0MaxOnTime + lightNr * 10] * driveTicksPerSecond;
+    }
+    // Idle, cutoff, or hold without maximum on-time: nothing to count
+    if (ticks == 0)
+    {
+        drivePhase[lightNr] = phase;
+        driveArmed &= ~(1 << lightNr);
+        return;
+    }
+    if (driveArmed == 0)
+        driveTickLastMillis = millis();
+    drivePhase[lightNr] = phase;
+    driveCount[lightNr] = ticks;
+    driveArmed |= 1 << lightNr;
+}
+
+// Called every loop when some outputs have a drive profile: start or stop the profiles of the lights
+// turned on or off, and count down the armed phases every driveTickInterval
+void updateDriveOutputs()
+{
+    uint8_t changed = (LIGHT_FLAGS ^ driveLightsOn) & driveLights;
+    if (changed)
+    {
+        for (uint8_t lightNr = 0; lightNr < numberOfLights; lightNr++)
+        {
+            if (!(changed & (1 << lightNr)))
+                continue;
+            driveLightsOn ^= 1 << lightNr;
+            if (driveLightsOn & (1 << lightNr))
+                startDrivePhase(lightNr, DriveKick, cvsCache[CV106Light0KickTime + lightNr * 10]);
+            else
+                startDrivePhase(lightNr, DriveIdle, 0);
+        }
+    }
+
+    if (driveArmed == 0 || millis() - driveTickLastMillis < driveTickInterval)
+        return;
+    driveTickLastMillis += driveTickInterval;
+    for (uint8_t lightNr = 0; lightNr < numberOfLights; lightNr++)
+    {
+        if ((driveArmed & (1 << lightNr)) && --driveCount[lightNr] == 0)
+        {
+            if (drivePhase[lightNr] == DriveKick)
+                startDrivePhase(lightNr, DriveHold, cvsCache[CV108Light0MaxOnTime + lightNr * 10] * driveTicksPerSecond);
+            else
+            {
+                startDrivePhase(lightNr, DriveCutoff, 0);
+                recordEvent(EventDriveCutoff, lightNr);
+            }
+        }
+    }
+}
+
+// Duty of a driven output, from the value of its light
+uint8_t driveDuty(uint8_t lightNr, uint8_t value)
+{
+    uint8_t hold;
+    switch (drivePhase[lightNr])
+    {
+    case DriveKick:
+        return (255);
+        break;
+
+    case DriveHold:
+        hold = cvsCache[CV107Light0HoldDuty + lightNr * 10];
+        return ((value < hold) ? value : hold);
+        break;
+
+    default: // Idle or cutoff
+        return (0);
+        break;
+    }
+}
+
+// Process the value of light outputs
+// When the total duty exceeds the power budget, the normal lights are dimmed first, then the protected ones
+// The duty is written directly to the TCA0 compare register routed to each light (see updateLightRouting()).
+// A duty of 255 is above the period (254) set by megaTinyCore, so the output stays high
+void updateLightOutputs()
+{
+    uint16_t dutyProtected = 0;
+    uint16_t dutyNormal = 0;
+    for (uint8_t lightNr = 0; lightNr < numberOfLights; lightNr++)
+    {
+        lightDuty[lightNr] = valueLight(lightNr);
+        if (driveLights & (1 << lightNr))
+            lightDuty[lightNr] = driveDuty(lightNr, lightDuty[lightNr]);
+        if (powerUpScale != 256)
+            lightDuty[lightNr] = (lightDuty[lightNr] * powerUpScale) >> 8;
+        if (powerProtectedLights & (1 << lightNr))
+            dutyProtected += lightDuty[lightNr];
+        else
+            dutyNormal += lightDuty[lightNr];
+    }
+
+    if (dutyProtected + dutyNormal > powerBudget)
+    {
+        uint16_t scaleProtected = 256;
+        uint16_t scaleNormal = 0;
+        if (dutyProtected > powerBudget)
+            scaleProtected = powerScale(powerBudget, dutyProtected);
+        else
+            scaleNormal = powerScale(powerBudget - dutyProtected, dutyNormal);
+        for (uint8_t lightNr = 0; lightNr < numberOfLights; lightNr++)
+            lightDuty[lightNr] = (lightDuty[lightNr] * ((powerProtectedLights & (1 << lightNr)) ? scaleProtected : scaleNormal)) >> 8;
+    }
+
+    // The pads at duty 0 are disconnected from their compare, the pads not driven by any light stay disconnected
+    uint8_t compareEnable = 0;
+    for (uint8_t lightNr = 0; lightNr < numberOfLights; lightNr++)
+    {
+        *lightCompare[lightNr] = lightDuty[lightNr];
+        if (lightDuty[lightNr] != 0)
+            compareEnable |= lightCompareEnableBit[lightNr];
+        else
+            compareEnable &= ~lightCompareEnableBit[lightNr];
+    }
+    TCA0.SPLIT.CTRLB = (TCA0.SPLIT.CTRLB & ~padCompareEnable) | compareEnable;
+}
+
+// Shared periodic tick for the time based processing of lights
+const uint32_t tickInterval = 100; // ms
+uint32_t tickLastMillis = 0;
+
+void processTick()
+{
+    updateLightTimers();
+    updateLightUsage();
+}
+
+// This callback function is called by the NmraDcc library when a DCC ACK needs to be sent
+// Calling this function should cause an increased 60mA current drain on the power supply for 6ms to ACK a CV Read
+void notifyCVAck(void)
+{
+#ifdef DEBUG
+    Serial.println("notifyCVAck");
+#endif
+    recordEvent(EventCVAck, 0);
+
+    digitalWrite(pinACKOutput, HIGH);
+    delay(8);
+    digitalWrite(pinACKOutput, LOW);
+}
+
+// Watchdog timing (in ms). The watchdog runs from the 1.024 kHz internal oscillator, so 1 clock is about 1 ms
+const uint32_t wdtKickInterval = 64;
+const uint32_t wdtClosedWindow = 32;  // WDT_WINDOW_32CLK_gc
+const uint32_t wdtOpenWindow = 256;   // WDT_PERIOD_256CLK_gc
+const uint32_t factoryResetTimeout = 1000; // Maximum time (in ms) between two CVs written by a factory reset
+uint32_t wdtLastKick = 0;
+
+// The decoder is healthy when the pending work makes progress and the state in RAM is consistent
+bool isHealthy()
+{
+    if (FactoryDefaultCVIndex && millis() - factoryResetLastProgress > factoryResetTimeout)
+        return (false);
+    if (flightRecorder.magic != flightRecorderMagic || flightRecorder.next >= flightRecorderSize)
+        return (false);
+    return (true);
+}
+
+void setup()
+{
+    // Read and clear the reset flags
+    uint8_t resetFlags = RSTCTRL.RSTFR;
+    RSTCTRL.RSTFR = resetFlags;
+    initFlightRecorder(resetFlags);
+    updateResetCounters(resetFlags);
+
+    // Set light pins and DCC ACK pin to outputs
+    // The light pads are connected to their TCA0 compare by updateLightOutputs() when their duty is not 0
+    // (WO3 on PA3, the ACK pin, is left disabled)
+    for (uint8_t lightNr = 0; lightNr < numberOfLights; lightNr++)
+    {
+        digitalWrite(pinLight[lightNr], LOW);
+        pinMode(pinLight[lightNr], OUTPUT);
+        *padCompare[lightNr] = 0;
+    }
+    TCA0.SPLIT.CTRLB &= ~padCompareEnable;
+    TCA0.SPLIT.CTRLA = TCA_SPLIT_CLKSEL_DIV8_gc | TCA_SPLIT_ENABLE_bm;
+
+    digitalWrite(pinACKOutput, 0);
+    pinMode(pinACKOutput, OUTPUT);
+
+#if defined(DEBUG) || defined(SERIAL_CONFIG)
+    // Serial TX used for debugging messages and the serial configuration port
+    // Two mapping options for Serial are PB2, PB3, PB1, PB0 (default) and PA1, PA2, PA3, PA4 for TX, RX, XCK, XDIR.
+    Serial.swap(); // Use the second set of serial pins. TX is on PA1
+    Serial.begin(115200);
+#endif
+
+#ifdef SERIAL_CONFIG
+    serialConfig();
+#ifndef DEBUG
+    // Release PA2 (RX) for the DCC input
+    Serial.end();
+#endif
+#endif
+
+#ifdef DEBUG
+    Serial.println();
+    Serial.println("-- Starting tiny DCC decoder --");
+#endif
+
+    // All lights off, locos going forward
+    LIGHT_FLAGS = 0;
+    OUR_ADDRESS_FLAGS = flagForward;
+    SECOND_ADDRESS_FLAGS = flagForward;
+    readFctsToCache();
+    readLightUsage();
+    readCvsToCache(); // Before Dcc.init(), which reads CVs through notifyCVRead()
+    upgradeCVs();
+    updateDecoderLock();
+    updateListenAddresses();
+    updateLightRouting();
+
+    // Initialize the NmraDcc library
+    // void NmraDcc::pin (uint8_t ExtIntPinNum, uint8_t EnablePullup)
+    // void NmraDcc::init (uint8_t ManufacturerId, uint8_t VersionId, uint8_t Flags, uint8_t OpsModeAddressBaseCV)
+    Dcc.pin(pinDCCInput, false);
+    // With FLAGS_MY_ADDRESS_ONLY, the second address is handled by notifyDccMsg() (see listenAddresses[])
+    Dcc.init(MAN_ID_DIY, versionId, FLAGS_MY_ADDRESS_ONLY | FLAGS_AUTO_FACTORY_DEFAULT, 0);
+
+    // Commented out as not necessary with Attiny
+    // notifyCVResetFactoryDefault() is automatically called
+    // at very first call (i.e. unprogrammed EEPROM) of NmraDcc::init() with FLAGS_AUTO_FACTORY_DEFAULT set
+    // notifyCVResetFactoryDefault();
+
+    updateLightParams();
+    updateBinaryStatesUsed();
+    updateLightBrightness();
+    updatePowerBudget();
+    updateDriveLights();
+    updateConfirmFilter();
+    updateLightCache();
+    initPowerUp(resetFlags);
+#ifdef ISR_PROFILE
+    initIsrProfile();
+#endif
+
+    // Start the watchdog
+    _PROTECTED_WRITE(WDT.CTRLA, WDT_WINDOW_32CLK_gc | WDT_PERIOD_256CLK_gc);
+    wdtLastKick = millis();
+    tickLastMillis = millis();
+}
+
+#ifdef DEBUG
+uint16_t loopCounterLow = 20000;
+uint16_t loopCounterHigh = 0;
+#endif
+
+void loop()
+{
+#ifdef DEBUG
+    if (loopCounterLow == 20000)
+    {
+        loopCounterLow = 0;
+        Serial.print("loop ");
+        Serial.println(loopCounterHigh);
+        loopCounterHigh++;
+    }
+    loopCounterLow++;
+#endif
+
+    // Process DCC packets
+    Dcc.process();
+
+    // Process the value of light outputs
+    updateEffectClock();
+    if (powerUpScale != 256)
+        updatePowerUp();
+    if (driveLights)
+        updateDriveOutputs();
+    updateLightOutputs();
+
+    // Process the periodic tick
+    if (millis() - tickLastMillis >= tickInterval)
+    {
+        tickLastMillis += tickInterval;
+        processTick();
+    }
 
     // Handle resetting CVs to Factory Defaults
     if (FactoryDefaultCVIndex && Dcc.isSetCVReady())
     {
         FactoryDefaultCVIndex--; // Decrement first as initially it is the size of the array
-        Dcc.setCV(FactoryDefaultCVs[FactoryDefaultCVIndex].CV, FactoryDefaultCVs[FactoryDefaultCVIndex].Value);
+        // Above the cache, the EEPROM holds the counters, the light usage and the flight recorder
+        if (FactoryDefaultCVs[FactoryDefaultCVIndex].CV < numberOfCvsInCache)
+            Dcc.setCV(FactoryDefaultCVs[FactoryDefaultCVIndex].CV, FactoryDefaultCVs[FactoryDefaultCVIndex].Value);
+        factoryResetLastProgress = millis();
+    }
+
+    // Kick the watchdog
+    if (millis() - wdtLastKick >= wdtKickInterval && isHealthy())
+    {
+        wdtLastKick = millis();
+        wdt_reset();
     }
 }
\ No newline at end of file
@@ -0,0 +1,127 @@
+// Host stub of the megaTinyCore Arduino.h for the simulation of src/main.cpp (see hostsim.h)
+// Only what src/main.cpp uses is declared. The peripheral registers are plain variables
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+#define F_CPU 20000000UL
+#define HIGH 1
+#define LOW 0
+#define INPUT 0
+#define OUTPUT 1
+#define DEC 10
+#define HEX 16
+#define BIN 2
+
+typedef uint8_t pin_size_t;
+enum
+{
+    PIN_PA0, PIN_PA1, PIN_PA2, PIN_PA3, PIN_PA4, PIN_PA5, PIN_PA6, PIN_PA7,
+    PIN_PB0, PIN_PB1, PIN_PB2, PIN_PB3, PIN_PB4, PIN_PB5, PIN_PC0, PIN_PC1, PIN_PC2, PIN_PC3
+};
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+void pinMode(pin_size_t pin, uint8_t mode);
+void digitalWrite(pin_size_t pin, uint8_t value);
+void analogWrite(pin_size_t pin, int value);
+inline void noInterrupts() {}
+inline void interrupts() {}
+#define cli() noInterrupts()
+#define sei() interrupts()
+
+#define ISR(vector) extern "C" void vector()
+#define PROGMEM
+
+struct HardwareSerial
+{
+    void swap(uint8_t = 1) {}
+    void begin(unsigned long) {}
+    void end() {}
+    int available(); // Advances the simulated time, so that the loops polling it time out
+    int read() { return (-1); }
+    size_t write(uint8_t) { return (1); }
+    void flush() {}
+    template <typename T> size_t print(T, int = DEC) { return (0); }
+    template <typename T> size_t println(T, int = DEC) { return (0); }
+    size_t println() { return (0); }
+};
+extern HardwareSerial Serial;
+
+typedef volatile uint8_t register8_t;
+typedef volatile uint16_t register16_t;
+
+extern register8_t hostGpior[4];
+#define GPIOR0 (hostGpior[0])
+#define GPIOR1 (hostGpior[1])
+#define GPIOR2 (hostGpior[2])
+#define GPIOR3 (hostGpior[3])
+
+#define _PROTECTED_WRITE(reg, value) ((reg) = (value))
+#define _PROTECTED_WRITE_SPM(reg, value) ((reg) = (value))
+
+struct RSTCTRL_t { register8_t RSTFR, SWRR; };
+extern RSTCTRL_t RSTCTRL;
+#define RSTCTRL_PORF_bm 0x01
+#define RSTCTRL_BORF_bm 0x02
+#define RSTCTRL_EXTRF_bm 0x04
+#define RSTCTRL_WDRF_bm 0x08
+#define RSTCTRL_SWRF_bm 0x10
+#define RSTCTRL_UPDIRF_bm 0x20
+#define RSTCTRL_SWRE_bm 0x01
+
+struct WDT_t { register8_t CTRLA, STATUS; };
+extern WDT_t WDT;
+#define WDT_PERIOD_256CLK_gc 0x06
+#define WDT_WINDOW_32CLK_gc 0x30
+
+// The EEPROM is mapped at EEPROM_START in the data space: here hostEeprom[]
+struct NVMCTRL_t { register8_t CTRLA, CTRLB, STATUS; };
+extern NVMCTRL_t NVMCTRL;
+#define NVMCTRL_CMD_PAGEERASEWRITE_gc 0x03
+#define NVMCTRL_CMD_PAGEBUFCLR_gc 0x04
+#define NVMCTRL_EEBUSY_bm 0x02
+extern uint8_t hostEeprom[256];
+#define EEPROM_START ((uintptr_t)hostEeprom)
+#define EEPROM_PAGE_SIZE 32
+#define EEPROM_SIZE 256
+#define E2END 0xFF
+
+struct SIGROW_t { register8_t SERNUM0, SERNUM1, SERNUM2, SERNUM3, SERNUM4, SERNUM5, SERNUM6, SERNUM7, SERNUM8, SERNUM9; };
+extern SIGROW_t SIGROW;
+
+struct TCA_SPLIT_t
+{
+    register8_t CTRLA, CTRLB, CTRLC, CTRLD, CTRLECLR, CTRLESET, LCNT, HCNT, LPER, HPER;
+    register8_t LCMP0, HCMP0, LCMP1, HCMP1, LCMP2, HCMP2;
+};
+struct TCA_t { TCA_SPLIT_t SPLIT; };
+extern TCA_t TCA0;
+#define TCA_SPLIT_ENABLE_bm 0x01
+#define TCA_SPLIT_CLKSEL_DIV8_gc 0x06
+#define TCA_SPLIT_LCMP0EN_bm 0x01
+#define TCA_SPLIT_LCMP1EN_bm 0x02
+#define TCA_SPLIT_LCMP2EN_bm 0x04
+#define TCA_SPLIT_HCMP0EN_bm 0x10
+#define TCA_SPLIT_HCMP1EN_bm 0x20
+#define TCA_SPLIT_HCMP2EN_bm 0x40
+
+struct TCB_t { register8_t CTRLA, CTRLB, EVCTRL, INTCTRL, INTFLAGS; register16_t CNT, CCMP; };
+extern TCB_t TCB0, TCB1;
+#define TCB_ENABLE_bm 0x01
+#define TCB_CLKSEL_CLKDIV2_gc 0x02
+#define TCB_CNTMODE_INT_gc 0x00
+#define TCB_CNTMODE_CAPT_gc 0x03
+#define TCB_CAPTEI_bm 0x01
+#define TCB_CAPT_bm 0x01
+
+struct EVSYS_t { register8_t ASYNCCH0, ASYNCUSER0; };
+extern EVSYS_t EVSYS;
+#define EVSYS_ASYNCCH0_PORTA_PIN2_gc 0x0C
+#define EVSYS_ASYNCUSER0_ASYNCCH0_gc 0x03
+
+struct CPUINT_t { register8_t CTRLA, STATUS, LVL0PRI, LVL1VEC; };
+extern CPUINT_t CPUINT;
+#define PORTA_PORT_vect_num 3
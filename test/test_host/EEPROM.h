@@ -0,0 +1,13 @@
+// Host stub of the megaTinyCore EEPROM library (see hostsim.h)
+// A write waits for the previous one to complete, then keeps the EEPROM busy for hostEepromWriteMicros
+#pragma once
+#include <stdint.h>
+
+struct EEPROMClass
+{
+    uint8_t read(int address);
+    void write(int address, uint8_t value);
+    void update(int address, uint8_t value);
+    uint16_t length() { return (256); }
+};
+extern EEPROMClass EEPROM;
@@ -0,0 +1,60 @@
+// Host stub of the NmraDcc library (see hostsim.h)
+// NmraDcc::process() delivers the packets queued by hostPacket() to the callbacks, decoding the multi function
+// decoder packets used by src/main.cpp as the library does: speed (14/28 and 128 steps), F0-F4, and the CV
+// writes on the main track (POM), with the same address filter (FLAGS_MY_ADDRESS_ONLY)
+#pragma once
+#include <stdint.h>
+
+#define MAX_DCC_MESSAGE_LEN 6
+
+typedef struct
+{
+    uint8_t Size;
+    uint8_t PreambleBits;
+    uint8_t Data[MAX_DCC_MESSAGE_LEN];
+} DCC_MSG;
+
+typedef enum { DCC_DIR_REV = 0, DCC_DIR_FWD = 1 } DCC_DIRECTION;
+typedef enum { DCC_ADDR_SHORT, DCC_ADDR_LONG } DCC_ADDR_TYPE;
+typedef enum { SPEED_STEP_14 = 15, SPEED_STEP_28 = 29, SPEED_STEP_128 = 127 } DCC_SPEED_STEPS;
+typedef enum { FN_0_4 = 1, FN_5_8, FN_9_12, FN_13_20, FN_21_28 } FN_GROUP;
+
+#define FN_BIT_00 0x10
+#define FN_BIT_01 0x01
+#define FN_BIT_02 0x02
+#define FN_BIT_03 0x04
+#define FN_BIT_04 0x08
+
+#define MAN_ID_DIY 0x0D
+#define FLAGS_MY_ADDRESS_ONLY 0x01
+#define FLAGS_AUTO_FACTORY_DEFAULT 0x02
+#define FLAGS_OUTPUT_ADDRESS_MODE 0x40
+#define FLAGS_DCC_ACCESSORY_DECODER 0x80
+#define FLAGS_CV29_BITS (FLAGS_OUTPUT_ADDRESS_MODE | FLAGS_DCC_ACCESSORY_DECODER)
+
+class NmraDcc
+{
+public:
+    void pin(uint8_t ExtIntPinNum, uint8_t EnablePullup) {}
+    void init(uint8_t ManufacturerId, uint8_t VersionId, uint8_t Flags, uint8_t OpsModeAddressBaseCV);
+    uint8_t process();
+    uint8_t getCV(uint16_t CV);
+    uint8_t setCV(uint16_t CV, uint8_t Value);
+    uint8_t isSetCVReady();
+    uint16_t getAddr();
+
+private:
+    uint8_t flags;
+};
+
+extern "C"
+{
+    extern void notifyDccSpeed(uint16_t Addr, DCC_ADDR_TYPE AddrType, uint8_t Speed, DCC_DIRECTION Dir, DCC_SPEED_STEPS SpeedSteps) __attribute__((weak));
+    extern void notifyDccFunc(uint16_t Addr, DCC_ADDR_TYPE AddrType, FN_GROUP FuncGrp, uint8_t FuncState) __attribute__((weak));
+    extern void notifyDccMsg(DCC_MSG *Msg) __attribute__((weak));
+    extern uint8_t notifyCVValid(uint16_t CV, uint8_t Writable) __attribute__((weak));
+    extern uint8_t notifyCVRead(uint16_t CV) __attribute__((weak));
+    extern void notifyCVChange(uint16_t CV, uint8_t Value) __attribute__((weak));
+    extern void notifyCVAck(void) __attribute__((weak));
+    extern void notifyCVResetFactoryDefault(void) __attribute__((weak));
+}
@@ -0,0 +1,4 @@
+// Host stub of avr-libc avr/wdt.h (see hostsim.h)
+#pragma once
+
+void wdt_reset();
@@ -0,0 +1,252 @@
+// Host simulation of src/main.cpp: stubs of the hardware and of the libraries (see hostsim.h)
+#include <string.h>
+#include <Arduino.h>
+#include <EEPROM.h>
+#include <NmraDcc.h>
+#include <avr/wdt.h>
+#include "hostsim.h"
+
+uint32_t hostMicros = 0;
+uint32_t hostLoopMicros = 100;
+uint32_t hostEepromReadyMicros = 0;
+
+register8_t hostGpior[4];
+RSTCTRL_t RSTCTRL;
+WDT_t WDT;
+NVMCTRL_t NVMCTRL;
+SIGROW_t SIGROW = {0x31, 0x42, 0x53, 0x64, 0x75, 0x86, 0x97, 0xA8, 0xB9, 0xCA};
+TCA_t TCA0;
+TCB_t TCB0, TCB1;
+EVSYS_t EVSYS;
+CPUINT_t CPUINT;
+HardwareSerial Serial;
+EEPROMClass EEPROM;
+uint8_t hostEeprom[256];
+uint8_t hostPinOut[PIN_PC3 + 1];
+
+unsigned long millis() { return (hostMicros / 1000); }
+unsigned long micros() { return (hostMicros); }
+void delay(unsigned long ms) { hostMicros += ms * 1000; }
+void delayMicroseconds(unsigned int us) { hostMicros += us; }
+void pinMode(pin_size_t pin, uint8_t mode) {}
+void digitalWrite(pin_size_t pin, uint8_t value) { hostPinOut[pin] = value; }
+void analogWrite(pin_size_t pin, int value) { hostPinOut[pin] = value > 127; }
+void wdt_reset() {}
+
+int HardwareSerial::available()
+{
+    hostMicros += 100;
+    return (0);
+}
+
+// EEPROM
+
+static void eepromWait()
+{
+    if ((int32_t)(hostEepromReadyMicros - hostMicros) > 0)
+        hostMicros = hostEepromReadyMicros;
+}
+
+uint8_t EEPROMClass::read(int address) { return (hostEeprom[address & 0xFF]); }
+
+void EEPROMClass::write(int address, uint8_t value)
+{
+    eepromWait();
+    hostEeprom[address & 0xFF] = value;
+    hostEepromReadyMicros = hostMicros + hostEepromWriteMicros;
+}
+
+void EEPROMClass::update(int address, uint8_t value)
+{
+    if (read(address) != value)
+        write(address, value);
+}
+
+void hostEraseEeprom() { memset(hostEeprom, 0xFF, sizeof(hostEeprom)); }
+uint8_t hostEepromRead(uint8_t address) { return (hostEeprom[address]); }
+
+// DCC packets
+
+struct HostPacket
+{
+    uint32_t arrival;
+    DCC_MSG msg;
+};
+const uint8_t hostQueueSize = 16;
+static HostPacket hostQueue[hostQueueSize];
+static uint8_t hostQueueCount = 0;
+
+void hostPacket(const uint8_t *data, uint8_t size, uint32_t delay)
+{
+    if (hostQueueCount == hostQueueSize)
+        return;
+    HostPacket *packet = &hostQueue[hostQueueCount++];
+    packet->arrival = hostMicros + delay;
+    packet->msg.Size = size + 1;
+    packet->msg.PreambleBits = 14;
+    uint8_t check = 0;
+    for (uint8_t i = 0; i < size; i++)
+    {
+        packet->msg.Data[i] = data[i];
+        check ^= data[i];
+    }
+    packet->msg.Data[size] = check;
+}
+
+void hostPacket(uint8_t byte0, uint8_t byte1)
+{
+    const uint8_t data[] = {byte0, byte1};
+    hostPacket(data, sizeof(data));
+}
+
+void hostPacket(uint8_t byte0, uint8_t byte1, uint8_t byte2)
+{
+    const uint8_t data[] = {byte0, byte1, byte2};
+    hostPacket(data, sizeof(data));
+}
+
+void hostPacket(uint8_t byte0, uint8_t byte1, uint8_t byte2, uint8_t byte3)
+{
+    const uint8_t data[] = {byte0, byte1, byte2, byte3};
+    hostPacket(data, sizeof(data));
+}
+
+uint8_t hostPacketsQueued() { return (hostQueueCount); }
+
+// NmraDcc
+
+static uint8_t readCV(uint16_t CV)
+{
+    if (notifyCVRead)
+        return (notifyCVRead(CV));
+    return (EEPROM.read(CV));
+}
+
+static uint8_t writeCV(uint16_t CV, uint8_t Value)
+{
+    if (EEPROM.read(CV) != Value)
+    {
+        EEPROM.write(CV, Value);
+        if (notifyCVChange)
+            notifyCVChange(CV, Value);
+    }
+    return (EEPROM.read(CV));
+}
+
+void NmraDcc::init(uint8_t ManufacturerId, uint8_t VersionId, uint8_t Flags, uint8_t OpsModeAddressBaseCV)
+{
+    flags = Flags;
+    hostQueueCount = 0;
+    writeCV(29, (readCV(29) & ~FLAGS_CV29_BITS) | (Flags & FLAGS_CV29_BITS));
+    bool autoFactoryDefault = (Flags & FLAGS_AUTO_FACTORY_DEFAULT) && readCV(7) == 255 && readCV(8) == 255;
+    writeCV(7, VersionId);
+    writeCV(8, ManufacturerId);
+    if (autoFactoryDefault && notifyCVResetFactoryDefault)
+        notifyCVResetFactoryDefault();
+}
+
+uint16_t NmraDcc::getAddr()
+{
+    if (readCV(29) & 0x20)
+        return ((uint16_t)(readCV(17) & 0x3F) << 8 | readCV(18));
+    return (readCV(1));
+}
+
+uint8_t NmraDcc::getCV(uint16_t CV) { return (readCV(CV)); }
+uint8_t NmraDcc::setCV(uint16_t CV, uint8_t Value) { return (writeCV(CV, Value)); }
+uint8_t NmraDcc::isSetCVReady() { return ((int32_t)(hostEepromReadyMicros - hostMicros) <= 0); }
+
+uint8_t NmraDcc::process()
+{
+    if (hostQueueCount == 0 || (int32_t)(hostQueue[0].arrival - hostMicros) > 0)
+        return (0);
+    DCC_MSG msg = hostQueue[0].msg;
+    hostQueueCount--;
+    memmove(&hostQueue[0], &hostQueue[1], hostQueueCount * sizeof(HostPacket));
+
+    if (notifyDccMsg)
+        notifyDccMsg(&msg);
+
+    // Multi function decoder packets only (no accessory, idle or reset packets)
+    uint8_t *data = msg.Data;
+    uint16_t addr;
+    DCC_ADDR_TYPE addrType = DCC_ADDR_SHORT;
+    uint8_t i;
+    if (data[0] < 128)
+    {
+        addr = data[0];
+        i = 1;
+    }
+    else if (data[0] >= 0xC0 && data[0] <= 0xE7 && msg.Size > 3)
+    {
+        addr = (uint16_t)(data[0] & 0x3F) << 8 | data[1];
+        addrType = DCC_ADDR_LONG;
+        i = 2;
+    }
+    else
+        return (1);
+    if ((flags & FLAGS_MY_ADDRESS_ONLY) && addr != getAddr() && addr != 0)
+        return (1);
+
+    uint8_t instruction = data[i];
+    if (instruction == 0x3F && msg.Size >= i + 3)
+    {
+        if (notifyDccSpeed)
+            notifyDccSpeed(addr, addrType, data[i + 1] & 0x7F, (data[i + 1] & 0x80) ? DCC_DIR_FWD : DCC_DIR_REV, SPEED_STEP_128);
+    }
+    else if ((instruction & 0xC0) == 0x40)
+    {
+        // 28 speed steps: 0 and 1 stop, 2 and 3 emergency stop, then steps 1 to 28 passed as 2 to 29
+        uint8_t speed = (instruction & 0x0F) << 1 | (instruction & 0x10) >> 4;
+        speed = (speed < 2) ? 0 : (speed < 4) ? 1 : speed - 2;
+        if (notifyDccSpeed)
+            notifyDccSpeed(addr, addrType, speed, (instruction & 0x20) ? DCC_DIR_FWD : DCC_DIR_REV, SPEED_STEP_28);
+    }
+    else if ((instruction & 0xE0) == 0x80)
+    {
+        if (notifyDccFunc)
+            notifyDccFunc(addr, addrType, FN_0_4, instruction & 0x1F);
+    }
+    else if ((instruction & 0xFC) == 0xEC && addr != 0 && msg.Size >= i + 4)
+    {
+        // CV write on the main track: 111011VV VVVVVVVV DDDDDDDD
+        uint16_t CV = ((uint16_t)(instruction & 0x03) << 8 | data[i + 1]) + 1;
+        if (!notifyCVValid || notifyCVValid(CV, 1))
+            writeCV(CV, data[i + 2]);
+    }
+    return (1);
+}
+
+// Simulation
+
+void hostBoot(uint8_t resetFlags)
+{
+    RSTCTRL.RSTFR = resetFlags;
+    memset(&TCA0, 0, sizeof(TCA0));
+    setup();
+}
+
+void hostLoop()
+{
+    loop();
+    hostMicros += hostLoopMicros;
+}
+
+void hostRun(uint32_t us)
+{
+    uint32_t start = hostMicros;
+    while (hostMicros - start < us)
+        hostLoop();
+}
+
+// Light pads of the PCB (see pinLight[] and padCompare[] in src/main.cpp)
+static const pin_size_t hostPadPin[] = {PIN_PB1, PIN_PB0, PIN_PA5, PIN_PB2, PIN_PA4};
+static register8_t *const hostPadCompare[] = {&TCA0.SPLIT.LCMP1, &TCA0.SPLIT.LCMP0, &TCA0.SPLIT.HCMP2, &TCA0.SPLIT.LCMP2, &TCA0.SPLIT.HCMP1};
+static const uint8_t hostPadEnable[] = {TCA_SPLIT_LCMP1EN_bm, TCA_SPLIT_LCMP0EN_bm, TCA_SPLIT_HCMP2EN_bm, TCA_SPLIT_LCMP2EN_bm, TCA_SPLIT_HCMP1EN_bm};
+
+uint8_t hostPadDuty(uint8_t pad)
+{
+    if (!(TCA0.SPLIT.CTRLB & hostPadEnable[pad]))
+        return (hostPinOut[hostPadPin[pad]] ? 255 : 0);
+    return (*hostPadCompare[pad] == 0 ? 1 : *hostPadCompare[pad]);
+}
@@ -0,0 +1,46 @@
+// Host simulation of src/main.cpp
+//
+// src/main.cpp is built for the host against the stubs of this directory (Arduino.h, EEPROM.h, NmraDcc.h,
+// avr/wdt.h) and driven by the tests: run with "pio test -e native"
+// - Time is simulated: hostMicros only advances when the tests run loop passes (hostLoopMicros each), when the
+//   firmware waits for the EEPROM (hostEepromWriteMicros per write) or polls the serial line, and in delay()
+// - DCC packets are queued with their arrival time and delivered by Dcc.process(), one per call as NmraDcc does
+// - The light outputs are read from the TCA0 registers written by the firmware
+#pragma once
+#include <stdint.h>
+
+// src/main.cpp
+void setup();
+void loop();
+
+extern uint32_t hostMicros;
+extern uint32_t hostLoopMicros;               // Simulated duration of one loop() pass
+const uint32_t hostEepromWriteMicros = 4000;  // Erase and write of one EEPROM byte
+
+// Erase the EEPROM (0xFF), as a new chip
+void hostEraseEeprom();
+
+// Reset the decoder with the reset flags (RSTCTRL.RSTFR) and run setup(). The RAM is not cleared as it is by
+// the C runtime of the chip: the state left by the previous run (e.g. the conditions of lights) is kept. Tests
+// which need a power on with the RAM cleared run it in a child process (see test_main.cpp)
+void hostBoot(uint8_t resetFlags);
+
+// Run loop() for at least us microseconds of simulated time
+void hostRun(uint32_t us);
+
+// Run one loop() pass
+void hostLoop();
+
+// Queue a DCC packet (without its error detection byte) arriving at hostMicros + delay
+void hostPacket(const uint8_t *data, uint8_t size, uint32_t delay = 0);
+void hostPacket(uint8_t byte0, uint8_t byte1);
+void hostPacket(uint8_t byte0, uint8_t byte1, uint8_t byte2);
+void hostPacket(uint8_t byte0, uint8_t byte1, uint8_t byte2, uint8_t byte3);
+uint8_t hostPacketsQueued();
+
+// Duty output on a light pad of the PCB (0..4): the level of its port pin (0 or 255) when the pad is disconnected
+// from its compare. A compare of 0 gives a duty of 1, as it still drives the output for one count of each period
+uint8_t hostPadDuty(uint8_t pad);
+
+// State of the EEPROM
+uint8_t hostEepromRead(uint8_t address);
@@ -0,0 +1,662 @@
+// Tests of src/main.cpp in the host simulation (see hostsim.h): pio test -e native
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <unity.h>
+#include <Arduino.h>
+#include <NmraDcc.h>
+#include "hostsim.h"
+
+extern NmraDcc Dcc;
+
+// Effect clock of src/main.cpp
+extern uint32_t effectClock;
+extern uint32_t effectClockLastMillis;
+extern uint32_t effectDriftStep;
+extern uint32_t effectDriftCounter;
+extern int8_t effectDriftDirection;
+void updateEffectClock();
+
+const uint8_t address = 3; // Factory default of CV1
+const uint8_t dccSpeed128 = 0x3F;
+const uint8_t dccFunctions = 0x80; // F0-F4: 100DDDDD, F0 in bit 4
+const uint8_t dccF0 = 0x10;
+
+static uint32_t randomState = 1;
+
+static uint32_t randomNumber(uint32_t range)
+{
+    randomState = randomState * 1103515245 + 12345;
+    return ((randomState >> 8) % range);
+}
+
+// New decoder: erased EEPROM, first power on with the automatic factory reset, then a second power on
+static void bootNewDecoder()
+{
+    hostEraseEeprom();
+    hostBoot(RSTCTRL_PORF_bm);
+    hostRun(1000000);
+    hostBoot(RSTCTRL_PORF_bm);
+    hostRun(2000000);
+}
+
+// Decoder flashed with version 1.3: CV1, CV7, CV8, CV29 and CV50 to CV54 of each light only
+static void writeVersion13Eeprom()
+{
+    hostEraseEeprom();
+    Dcc.setCV(1, address);
+    Dcc.setCV(7, 0x13);
+    Dcc.setCV(8, MAN_ID_DIY);
+    Dcc.setCV(29, 0);
+    for (uint8_t lightNr = 0; lightNr < 5; lightNr++)
+    {
+        Dcc.setCV(50 + lightNr * 10, 200); // Brightness set by the user
+        Dcc.setCV(51 + lightNr * 10, lightNr);
+        Dcc.setCV(52 + lightNr * 10, 0);
+        Dcc.setCV(53 + lightNr * 10, 0);
+        Dcc.setCV(54 + lightNr * 10, 0);
+    }
+}
+
+void setUp() {}
+void tearDown() {}
+
+// Each test runs in a child process, so that the RAM of the decoder starts cleared as after a power on
+// (hostBoot() does not clear it)
+static void runInChild(void (*test)(void))
+{
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        if (TEST_PROTECT())
+            test();
+        fflush(stdout);
+        _exit(Unity.CurrentTestFailed ? 1 : 0);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    TEST_ASSERT_TRUE_MESSAGE(WIFEXITED(status) && WEXITSTATUS(status) == 0, "failed in the child process");
+}
+
+// Reaction time from the end of a stop packet to the light change (CV34 = 3: Light0 turned off)
+// The stop arrives at a random time, right after a function change whose EEPROM write is still pending
+static void check_emergency_stop_reaction()
+{
+    bootNewDecoder();
+    Dcc.setCV(34, 3);
+    Dcc.setCV(35, 0x01);
+    hostPacket(address, dccFunctions | dccF0);
+    hostPacket(address, dccSpeed128, 0x80 | 20);
+    hostRun(500000);
+    TEST_ASSERT_GREATER_THAN_UINT8(0, hostPadDuty(0));
+
+    const uint8_t stops[][3] = {{0x00, dccSpeed128, 0x01}, {address, dccSpeed128, 0x81}, {0x00, 0x40, 0}};
+    uint32_t reactionMax = 0;
+    uint8_t functions = dccF0;
+    for (uint16_t trial = 0; trial < 300; trial++)
+    {
+        // Drive again, which ends the reaction
+        hostPacket(address, dccSpeed128, 0x80 | 20);
+        hostRun(100000);
+        TEST_ASSERT_GREATER_THAN_UINT8(0, hostPadDuty(0));
+
+        functions ^= 0x01; // F1, saved to the EEPROM
+        hostPacket(address, dccFunctions | functions);
+        hostLoop();
+        const uint8_t *stop = stops[trial % 3];
+        uint8_t size = (stop[2] || stop[1] == dccSpeed128) ? 3 : 2;
+        uint32_t arrival = hostMicros + randomNumber(3 * hostLoopMicros);
+        hostPacket(stop, size, arrival - hostMicros);
+        for (uint16_t passes = 0;; passes++)
+        {
+            TEST_ASSERT_TRUE(passes < 10000);
+            loop();
+            if (hostPadDuty(0) == 0)
+                break;
+            hostMicros += hostLoopMicros;
+        }
+        uint32_t reaction = hostMicros - arrival;
+        if (reaction > reactionMax)
+            reactionMax = reaction;
+        hostMicros += hostLoopMicros;
+    }
+
+    char message[120];
+    snprintf(message, sizeof(message), "Emergency stop reaction: %lu us at most, with loop passes of %lu us",
+             (unsigned long)reactionMax, (unsigned long)hostLoopMicros);
+    TEST_MESSAGE(message);
+    TEST_ASSERT_LESS_OR_EQUAL_UINT32(hostLoopMicros, reactionMax);
+}
+
+// Upgrade from 1.3 with the EEPROM kept: the new CVs get their default, the CVs of 1.3 keep their value
+static void check_firmware_upgrade()
+{
+    writeVersion13Eeprom();
+    hostBoot(RSTCTRL_PORF_bm);
+    hostRun(2000000);
+    TEST_ASSERT_EQUAL_UINT8(0x14, Dcc.getCV(7));
+    TEST_ASSERT_EQUAL_UINT8(200, Dcc.getCV(50));
+    TEST_ASSERT_EQUAL_UINT8(3, Dcc.getCV(81));
+    TEST_ASSERT_EQUAL_UINT8(0, Dcc.getCV(56));  // Binary state
+    TEST_ASSERT_EQUAL_UINT8(0, Dcc.getCV(59));  // Address
+    TEST_ASSERT_EQUAL_UINT8(0, Dcc.getCV(100)); // On delay
+    TEST_ASSERT_EQUAL_UINT8(255, Dcc.getCV(107)); // Hold duty
+    TEST_ASSERT_EQUAL_UINT8(4, Dcc.getCV(149)); // Output of Light4
+    hostPacket(address, dccFunctions | dccF0);
+    hostRun(100000);
+    TEST_ASSERT_GREATER_THAN_UINT8(0, hostPadDuty(0));
+
+    // The CVs written after the upgrade are kept at the next power on
+    Dcc.setCV(56, 7);
+    hostRun(100000);
+    hostBoot(RSTCTRL_PORF_bm);
+    TEST_ASSERT_EQUAL_UINT8(7, Dcc.getCV(56));
+}
+
+// The CVs written after a factory reset are kept at the next power on (CV7 is not seen as an older version)
+static void check_factory_reset_then_power_on()
+{
+    bootNewDecoder();
+    notifyCVResetFactoryDefault();
+    hostRun(1000000);
+    Dcc.setCV(56, 7);
+    hostRun(100000);
+    hostBoot(RSTCTRL_PORF_bm);
+    TEST_ASSERT_EQUAL_UINT8(7, Dcc.getCV(56));
+}
+
+// Reset counters (CV150 to CV153) of a new decoder, started from 0 at the first power on
+static void check_reset_counters()
+{
+    bootNewDecoder();
+    TEST_ASSERT_EQUAL_UINT8(0, Dcc.getCV(150));
+    TEST_ASSERT_EQUAL_UINT8(0, Dcc.getCV(151));
+    TEST_ASSERT_EQUAL_UINT8(2, Dcc.getCV(152));
+    TEST_ASSERT_EQUAL_UINT8(0, Dcc.getCV(153));
+    hostBoot(RSTCTRL_WDRF_bm);
+    hostBoot(RSTCTRL_BORF_bm | RSTCTRL_PORF_bm);
+    TEST_ASSERT_EQUAL_UINT8(1, Dcc.getCV(150));
+    TEST_ASSERT_EQUAL_UINT8(1, Dcc.getCV(151));
+    TEST_ASSERT_EQUAL_UINT8(3, Dcc.getCV(152));
+
+    // Upgrade from 1.3, without counters
+    writeVersion13Eeprom();
+    hostBoot(RSTCTRL_PORF_bm);
+    TEST_ASSERT_EQUAL_UINT8(0, Dcc.getCV(150));
+    TEST_ASSERT_EQUAL_UINT8(1, Dcc.getCV(152));
+}
+
+// Run a phase of a test from a power on in a child process, so that it starts with the RAM cleared even if the
+// previous phases ran setup(). The EEPROM is passed back to the caller, which must not run the firmware itself
+static void runPowerOn(void (*phase)(void))
+{
+    static uint8_t *eeprom = (uint8_t *)mmap(NULL, sizeof(hostEeprom), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        phase();
+        memcpy(eeprom, hostEeprom, sizeof(hostEeprom));
+        fflush(stdout);
+        _exit(0);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    TEST_ASSERT_TRUE_MESSAGE(WIFEXITED(status) && WEXITSTATUS(status) == 0, "failed in a power on");
+    memcpy(hostEeprom, eeprom, sizeof(hostEeprom));
+}
+
+static void newDecoderWithLight0On()
+{
+    bootNewDecoder();
+    hostPacket(address, dccFunctions | dccF0);
+    hostRun(100000);
+}
+
+static void lightOnSession()
+{
+    hostBoot(RSTCTRL_PORF_bm);
+    hostRun(241000000);
+    TEST_ASSERT_GREATER_THAN_UINT8(0, hostPadDuty(0));
+}
+
+// Operating hours of Light0 over 10 power ons of 4 min (0.67 h), each shorter than the unit of the totals (0.1 h)
+static void check_light_usage_sessions()
+{
+    runPowerOn(newDecoderWithLight0On);
+    for (uint8_t session = 0; session < 10; session++)
+        runPowerOn(lightOnSession);
+    hostBoot(RSTCTRL_PORF_bm);
+    uint16_t onTime = Dcc.getCV(154) | Dcc.getCV(155) << 8;
+    TEST_ASSERT_UINT16_WITHIN(1, 7, onTime);
+    uint16_t energy = Dcc.getCV(156) | Dcc.getCV(157) << 8;
+    TEST_ASSERT_LESS_OR_EQUAL_UINT16(onTime, energy);
+
+    // The slots have the AVR layout: 27 bytes, the on-time of Light0 after the sequence, the checksum last
+    uint8_t slot = (int8_t)(hostEepromRead(181) - hostEepromRead(154)) > 0 ? 181 : 154;
+    TEST_ASSERT_EQUAL_UINT16(onTime, hostEepromRead(slot + 1) | hostEepromRead(slot + 2) << 8);
+    uint8_t checksum = 0x5A;
+    for (uint8_t i = 0; i < 26; i++)
+        checksum += hostEepromRead(slot + i);
+    TEST_ASSERT_EQUAL_UINT8(checksum, hostEepromRead(slot + 26));
+}
+
+// Drift correction of the effect clock: one ms skipped every 10 ms, across a stalled loop pass
+static void check_effect_drift_after_stall()
+{
+    bootNewDecoder();
+    effectDriftDirection = -1;
+    effectDriftStep = 10;
+    effectDriftCounter = 0;
+    updateEffectClock();
+    uint32_t start = effectClock;
+    hostMicros += 5000000;
+    updateEffectClock();
+    TEST_ASSERT_EQUAL_UINT32(4500, effectClock - start);
+
+    // A skip due when no ms elapsed waits for the next ms instead of running the clock backwards
+    effectDriftCounter = effectDriftStep;
+    start = effectClock;
+    updateEffectClock();
+    TEST_ASSERT_EQUAL_UINT32(0, effectClock - start);
+    hostMicros += 1000;
+    updateEffectClock();
+    TEST_ASSERT_EQUAL_UINT32(0, effectClock - start);
+}
+
+// Stock profile of Light0 (CV58 = 1: headlight, F0, forward only), with its brightness overridden by CV50 (+128)
+static void check_profile_brightness_override()
+{
+    bootNewDecoder();
+    hostPacket(address, dccFunctions | dccF0);
+    hostRun(100000);
+    uint8_t ownDuty = hostPadDuty(0);
+    Dcc.setCV(58, 1);
+    hostRun(100000);
+    uint8_t profileDuty = hostPadDuty(0);
+    TEST_ASSERT_GREATER_THAN_UINT8(ownDuty, profileDuty);
+    Dcc.setCV(58, 129);
+    hostRun(100000);
+    TEST_ASSERT_EQUAL_UINT8(ownDuty, hostPadDuty(0));
+
+    // The rest comes from the profile: forward only
+    hostPacket(address, dccSpeed128, 0x00);
+    hostRun(100000);
+    TEST_ASSERT_EQUAL_UINT8(0, hostPadDuty(0));
+}
+
+// Tuning mode of Light0 with F1 (CV40 = 1, CV41 = 1)
+static void check_tuning()
+{
+    const uint8_t dccF1 = 0x01;
+    bootNewDecoder();
+    Dcc.setCV(40, 1);
+    Dcc.setCV(41, 1);
+    hostPacket(address, dccFunctions | dccF0);
+    hostRun(100000);
+
+    // The analog level halves the light: the CV committed is still the unscaled brightness
+    Dcc.setCV(104, 1);
+    hostPacket(address, 0x3D, 1, 127);
+    hostRun(100000);
+    uint8_t halfDuty = hostPadDuty(0);
+    hostPacket(address, dccFunctions | dccF0 | dccF1);
+    hostRun(100000);
+    TEST_ASSERT_EQUAL_UINT8(halfDuty, hostPadDuty(0));
+    hostPacket(address, dccFunctions | dccF0);
+    hostRun(100000);
+    TEST_ASSERT_EQUAL_UINT8(144, Dcc.getCV(50));
+    TEST_ASSERT_EQUAL_UINT8(halfDuty, hostPadDuty(0));
+
+    // A light with the brightness of a stock profile is not tuned
+    Dcc.setCV(58, 1);
+    hostRun(100000);
+    uint8_t profileDuty = hostPadDuty(0);
+    hostPacket(address, dccFunctions | dccF0 | dccF1);
+    hostPacket(address, dccSpeed128, 0x80 | 127);
+    hostRun(100000);
+    TEST_ASSERT_EQUAL_UINT8(profileDuty, hostPadDuty(0));
+    hostPacket(address, dccFunctions | dccF0);
+    hostRun(100000);
+    TEST_ASSERT_EQUAL_UINT8(144, Dcc.getCV(50));
+
+    // With the brightness of the light (CV58 + 128), the CV50 of the light is tuned
+    Dcc.setCV(58, 129);
+    hostPacket(address, dccFunctions | dccF0 | dccF1);
+    hostPacket(address, dccSpeed128, 0x80 | 127);
+    hostRun(100000);
+    hostPacket(address, dccFunctions | dccF0);
+    hostRun(100000);
+    TEST_ASSERT_EQUAL_UINT8(255, Dcc.getCV(50));
+}
+
+// CV writes on the main track (POM, 111011VV): only the packets of our address reach the EEPROM
+static void check_pom_address()
+{
+    const uint8_t pomWrite = 0xEC;
+    bootNewDecoder();
+    Dcc.setCV(42, 10); // Second address
+    hostRun(100000);
+    hostPacket(5, pomWrite, 50 - 1, 77);
+    hostPacket(10, pomWrite, 50 - 1, 77);
+    hostRun(100000);
+    TEST_ASSERT_EQUAL_UINT8(144, hostEepromRead(50));
+    TEST_ASSERT_EQUAL_UINT8(144, Dcc.getCV(50));
+    hostPacket(address, pomWrite, 50 - 1, 77);
+    hostRun(100000);
+    TEST_ASSERT_EQUAL_UINT8(77, hostEepromRead(50));
+}
+
+// Light0 following the second address (CV59 = 1): speed and functions decoded by notifyDccMsg()
+static void check_second_address()
+{
+    const uint8_t secondAddress = 10;
+    bootNewDecoder();
+    Dcc.setCV(42, secondAddress);
+    Dcc.setCV(52, 2); // Reverse only
+    Dcc.setCV(59, 1);
+    hostRun(100000);
+    hostPacket(address, dccFunctions | dccF0);
+    hostRun(100000);
+    TEST_ASSERT_EQUAL_UINT8(0, hostPadDuty(0));
+    hostPacket(secondAddress, dccFunctions | dccF0);
+    hostPacket(secondAddress, 0x40 | 0x08); // 28 steps, reverse
+    hostRun(100000);
+    TEST_ASSERT_GREATER_THAN_UINT8(0, hostPadDuty(0));
+    hostPacket(secondAddress, dccSpeed128, 0x80 | 20); // Forward
+    hostRun(100000);
+    TEST_ASSERT_EQUAL_UINT8(0, hostPadDuty(0));
+    hostPacket(address, dccSpeed128, 0x00 | 20); // Our address, reverse
+    hostRun(100000);
+    TEST_ASSERT_EQUAL_UINT8(0, hostPadDuty(0));
+}
+
+// Power up ramp of 5 s (CV45 = 50): on power on resets only, not at the first power on of a new decoder
+static void newDecoderWithRamp()
+{
+    hostEraseEeprom();
+    hostBoot(RSTCTRL_PORF_bm);
+    hostRun(1000000); // Factory reset
+    hostPacket(address, dccFunctions);
+    hostPacket(address, dccFunctions | dccF0);
+    hostRun(100000);
+    TEST_ASSERT_GREATER_THAN_UINT8(0, hostPadDuty(0));
+    TEST_ASSERT_EQUAL_UINT8(0, Dcc.getCV(44));
+    TEST_ASSERT_EQUAL_UINT8(0, Dcc.getCV(45));
+    Dcc.setCV(45, 50);
+    hostRun(100000);
+}
+
+static void watchdogResetWithoutRamp()
+{
+    hostBoot(RSTCTRL_WDRF_bm);
+    hostRun(100000);
+    uint8_t duty = hostPadDuty(0);
+    hostRun(5000000);
+    TEST_ASSERT_GREATER_THAN_UINT8(0, duty);
+    TEST_ASSERT_EQUAL_UINT8(hostPadDuty(0), duty);
+}
+
+static void powerOnWithRamp()
+{
+    hostBoot(RSTCTRL_PORF_bm);
+    hostRun(100000);
+    uint8_t duty = hostPadDuty(0);
+    hostRun(5000000);
+    TEST_ASSERT_LESS_THAN_UINT8(hostPadDuty(0) / 4, duty);
+}
+
+static void check_power_up()
+{
+    runPowerOn(newDecoderWithRamp);
+    runPowerOn(watchdogResetWithoutRamp);
+    runPowerOn(powerOnWithRamp);
+}
+
+// Light0 gated on a binary state (CV56), set by the short form (11011101 DLLLLLLL) for the states up to 127
+// and by the long form (11000000 DLLLLLLL HHHHHHHH) above
+static void check_binary_state()
+{
+    const uint8_t binaryStateShort = 0xDD;
+    const uint8_t binaryStateLong = 0xC0;
+    const uint8_t stateOn = 0x80;
+    bootNewDecoder();
+    Dcc.setCV(56, 5);
+    hostPacket(address, dccFunctions | dccF0);
+    hostRun(100000);
+    TEST_ASSERT_EQUAL_UINT8(0, hostPadDuty(0));
+    hostPacket(address, binaryStateShort, stateOn | 6); // Another state
+    hostRun(100000);
+    TEST_ASSERT_EQUAL_UINT8(0, hostPadDuty(0));
+    hostPacket(address, binaryStateShort, stateOn | 5);
+    hostRun(100000);
+    TEST_ASSERT_GREATER_THAN_UINT8(0, hostPadDuty(0));
+    hostPacket(address, binaryStateShort, 5);
+    hostRun(100000);
+    TEST_ASSERT_EQUAL_UINT8(0, hostPadDuty(0));
+
+    // State 200: low 7 bits in the first byte, high bits in the second
+    Dcc.setCV(56, 200);
+    hostPacket(address, binaryStateLong, stateOn | (200 & 0x7F), 200 >> 7);
+    hostRun(100000);
+    TEST_ASSERT_GREATER_THAN_UINT8(0, hostPadDuty(0));
+    hostPacket(address, binaryStateLong, 200 & 0x7F, 200 >> 7);
+    hostRun(100000);
+    TEST_ASSERT_EQUAL_UINT8(0, hostPadDuty(0));
+}
+
+// Decoder lock (CV15, CV16): the CV writes on the main track are rejected until CV15 matches the lock ID
+static void check_decoder_lock()
+{
+    const uint8_t pomWrite = 0xEC;
+    bootNewDecoder();
+    Dcc.setCV(16, 3);
+    hostRun(100000);
+    hostPacket(address, pomWrite, 50 - 1, 77);
+    hostPacket(address, pomWrite, 16 - 1, 0);
+    hostRun(100000);
+    TEST_ASSERT_EQUAL_UINT8(144, hostEepromRead(50));
+    TEST_ASSERT_EQUAL_UINT8(144, Dcc.getCV(50));
+    TEST_ASSERT_EQUAL_UINT8(3, Dcc.getCV(16));
+
+    // CV15 stays writable: the key unlocks the decoder
+    hostPacket(address, pomWrite, 15 - 1, 3);
+    hostPacket(address, pomWrite, 50 - 1, 77);
+    hostRun(100000);
+    TEST_ASSERT_EQUAL_UINT8(77, hostEepromRead(50));
+}
+
+// Confirmation filter (CV46 = 2, CV47 = 3): a function change is applied once 2 of the last 3 packets carry it,
+// so a single corrupted packet is ignored
+static void check_confirm_filter()
+{
+    bootNewDecoder();
+    Dcc.setCV(46, 2);
+    Dcc.setCV(47, 3);
+    // F0 as saved by the new decoder may be on. The confirmed candidate then leaves the window
+    for (uint8_t i = 0; i < 2 + 3; i++)
+        hostPacket(address, dccFunctions);
+    hostRun(100000);
+    TEST_ASSERT_EQUAL_UINT8(0, hostPadDuty(0));
+    hostPacket(address, dccFunctions | dccF0);
+    hostRun(100000);
+    TEST_ASSERT_EQUAL_UINT8(0, hostPadDuty(0));
+    hostPacket(address, dccFunctions | dccF0);
+    hostRun(100000);
+    TEST_ASSERT_GREATER_THAN_UINT8(0, hostPadDuty(0));
+
+    // A corrupted packet (F0 off) between packets of the current value
+    for (uint8_t i = 0; i < 3; i++)
+        hostPacket(address, dccFunctions | dccF0);
+    hostPacket(address, dccFunctions);
+    hostPacket(address, dccFunctions | dccF0);
+    hostPacket(address, dccFunctions | dccF0);
+    hostRun(100000);
+    TEST_ASSERT_GREATER_THAN_UINT8(0, hostPadDuty(0));
+
+    // Two packets out of three turn it off
+    hostPacket(address, dccFunctions);
+    hostPacket(address, dccFunctions | dccF0);
+    hostPacket(address, dccFunctions);
+    hostRun(100000);
+    TEST_ASSERT_EQUAL_UINT8(0, hostPadDuty(0));
+}
+
+// Night from a binary state (CV30 = 2, CV33 = 7): Light0 takes its night brightness (CV55) while the state is on
+static void check_day_night()
+{
+    const uint8_t binaryStateShort = 0xDD;
+    const uint8_t stateOn = 0x80;
+    bootNewDecoder();
+    Dcc.setCV(30, 2);
+    Dcc.setCV(33, 7);
+    Dcc.setCV(55, 80);
+    hostPacket(address, dccFunctions | dccF0);
+    hostRun(100000);
+    uint8_t dayDuty = hostPadDuty(0);
+    TEST_ASSERT_GREATER_THAN_UINT8(0, dayDuty);
+    hostPacket(address, binaryStateShort, stateOn | 7);
+    hostRun(100000);
+    uint8_t nightDuty = hostPadDuty(0);
+    TEST_ASSERT_GREATER_THAN_UINT8(0, nightDuty);
+    TEST_ASSERT_LESS_THAN_UINT8(dayDuty, nightDuty);
+    hostPacket(address, binaryStateShort, 7);
+    hostRun(100000);
+    TEST_ASSERT_EQUAL_UINT8(dayDuty, hostPadDuty(0));
+}
+
+// Flight recorder: the events before a watchdog reset are saved to CV208 to CV253 at the next boot
+static void check_flight_recorder()
+{
+    const uint8_t eventFunction = 4;
+    bootNewDecoder();
+    hostPacket(address, dccFunctions);
+    hostPacket(address, dccFunctions | dccF0);
+    hostRun(100000);
+    hostBoot(RSTCTRL_WDRF_bm);
+    hostRun(100000);
+    TEST_ASSERT_EQUAL_UINT8(RSTCTRL_WDRF_bm, Dcc.getCV(208));
+    uint8_t count = Dcc.getCV(209);
+    TEST_ASSERT_GREATER_THAN_UINT8(0, count);
+    TEST_ASSERT_LESS_OR_EQUAL_UINT8(11, count);
+
+    // The last function event is F0 on
+    uint8_t lastFunction = 0xFF;
+    for (uint8_t i = 0; i < count; i++)
+        if (Dcc.getCV(210 + i * 4 + 2) == eventFunction)
+            lastFunction = Dcc.getCV(210 + i * 4 + 3);
+    TEST_ASSERT_EQUAL_UINT8(dccF0, lastFunction);
+}
+
+// Power budget (CV39): Light0 at full brightness is dimmed to the budget of 20 / 255 of the five lights
+static void check_power_budget()
+{
+    bootNewDecoder();
+    Dcc.setCV(50, 255);
+    hostPacket(address, dccFunctions | dccF0);
+    hostRun(100000);
+    TEST_ASSERT_EQUAL_UINT8(255, hostPadDuty(0));
+    Dcc.setCV(39, 20);
+    hostRun(100000);
+    uint8_t duty = hostPadDuty(0);
+    TEST_ASSERT_UINT16_WITHIN(2, 20 * 5, duty);
+    Dcc.setCV(39, 255);
+    hostRun(100000);
+    TEST_ASSERT_EQUAL_UINT8(255, hostPadDuty(0));
+}
+
+// Timers of Light0: off delay of 1 s (CV101 = 5), then a one-shot of 0.6 s (CV102 = 3)
+static void check_light_timers()
+{
+    bootNewDecoder();
+    hostPacket(address, dccFunctions | dccF0);
+    hostRun(100000);
+    Dcc.setCV(101, 5);
+    hostPacket(address, dccFunctions);
+    hostRun(800000);
+    TEST_ASSERT_GREATER_THAN_UINT8(0, hostPadDuty(0));
+    hostRun(400000);
+    TEST_ASSERT_EQUAL_UINT8(0, hostPadDuty(0));
+
+    // The one-shot ends while F0 is still on
+    Dcc.setCV(101, 0);
+    Dcc.setCV(102, 3);
+    hostPacket(address, dccFunctions | dccF0);
+    hostRun(400000);
+    TEST_ASSERT_GREATER_THAN_UINT8(0, hostPadDuty(0));
+    hostRun(400000);
+    TEST_ASSERT_EQUAL_UINT8(0, hostPadDuty(0));
+}
+
+// Light0 and Light2 swapped (CV109 = 2, CV129 = 0): pad 2 follows F0, pad 0 follows F2
+static void check_light_routing()
+{
+    const uint8_t dccF2 = 0x02;
+    bootNewDecoder();
+    Dcc.setCV(109, 2);
+    Dcc.setCV(129, 0);
+    hostPacket(address, dccFunctions | dccF0);
+    hostRun(100000);
+    TEST_ASSERT_EQUAL_UINT8(0, hostPadDuty(0));
+    TEST_ASSERT_GREATER_THAN_UINT8(0, hostPadDuty(2));
+    hostPacket(address, dccFunctions | dccF2);
+    hostRun(100000);
+    TEST_ASSERT_EQUAL_UINT8(0, hostPadDuty(2));
+    TEST_ASSERT_GREATER_THAN_UINT8(0, hostPadDuty(0));
+
+    // An invalid pad selects the default one
+    Dcc.setCV(109, 9);
+    Dcc.setCV(129, 9);
+    hostPacket(address, dccFunctions | dccF0);
+    hostRun(100000);
+    TEST_ASSERT_GREATER_THAN_UINT8(0, hostPadDuty(0));
+    TEST_ASSERT_EQUAL_UINT8(0, hostPadDuty(2));
+}
+
+void test_emergency_stop_reaction() { runInChild(check_emergency_stop_reaction); }
+void test_firmware_upgrade() { runInChild(check_firmware_upgrade); }
+void test_factory_reset_then_power_on() { runInChild(check_factory_reset_then_power_on); }
+void test_reset_counters() { runInChild(check_reset_counters); }
+void test_light_usage_sessions() { runInChild(check_light_usage_sessions); }
+void test_effect_drift_after_stall() { runInChild(check_effect_drift_after_stall); }
+void test_profile_brightness_override() { runInChild(check_profile_brightness_override); }
+void test_tuning() { runInChild(check_tuning); }
+void test_pom_address() { runInChild(check_pom_address); }
+void test_second_address() { runInChild(check_second_address); }
+void test_power_up() { runInChild(check_power_up); }
+void test_binary_state() { runInChild(check_binary_state); }
+void test_decoder_lock() { runInChild(check_decoder_lock); }
+void test_confirm_filter() { runInChild(check_confirm_filter); }
+void test_day_night() { runInChild(check_day_night); }
+void test_flight_recorder() { runInChild(check_flight_recorder); }
+void test_power_budget() { runInChild(check_power_budget); }
+void test_light_timers() { runInChild(check_light_timers); }
+void test_light_routing() { runInChild(check_light_routing); }
+
+int main()
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_emergency_stop_reaction);
+    RUN_TEST(test_firmware_upgrade);
+    RUN_TEST(test_factory_reset_then_power_on);
+    RUN_TEST(test_reset_counters);
+    RUN_TEST(test_light_usage_sessions);
+    RUN_TEST(test_effect_drift_after_stall);
+    RUN_TEST(test_profile_brightness_override);
+    RUN_TEST(test_tuning);
+    RUN_TEST(test_pom_address);
+    RUN_TEST(test_second_address);
+    RUN_TEST(test_power_up);
+    RUN_TEST(test_binary_state);
+    RUN_TEST(test_decoder_lock);
+    RUN_TEST(test_confirm_filter);
+    RUN_TEST(test_day_night);
+    RUN_TEST(test_flight_recorder);
+    RUN_TEST(test_power_budget);
+    RUN_TEST(test_light_timers);
+    RUN_TEST(test_light_routing);
+    return (UNITY_END());
+}
@@ -0,0 +1,207 @@
+#!/usr/bin/env python3
+"""Replay a DCC packet capture through the confirmation filter of DCCLight1616 (CV46, CV47).
+
+For each pair of confirmation count N and window M, the speed/direction and F0-F4 packets for one address are
+run through the filter of the firmware (confirmValue() in src/main.cpp). The tool reports the glitches left
+(accepted changes undone within a few packets, seen as light flicker) and the latency added to real changes,
+in packets and in ms.
+
+The capture is a text file with one packet per line, as hexadecimal bytes including the error detection byte
+(e.g. "03 3F 92 AE"). Other tokens on the line, such as a time stamp, are ignored. Packets whose error
+detection byte is wrong are dropped, as by the decoder. Without a capture, --synthesize generates a stream
+in which corrupted packets still pass the checksum (one bit flipped in a data byte and in the error byte).
+
+Usage:
+    confirmsim.py capture.txt --address 3
+    confirmsim.py --synthesize 20000 --noise 0.01
+"""
+
+import argparse
+import random
+import sys
+
+INITIAL_STATE = {"speed": 128 << 8 | 0x80, "function": 0}  # Stopped, forward, functions off
+GLITCH_PACKETS = 3  # An accepted change followed by another one within this many packets is a glitch
+
+
+def parse_capture(path):
+    packets = []
+    with open(path) as f:
+        for line in f:
+            data = []
+            for token in line.split():
+                if len(token) == 2:
+                    try:
+                        data.append(int(token, 16))
+                    except ValueError:
+                        pass
+            if len(data) >= 3:
+                packets.append(data)
+    return packets
+
+
+def checksum_ok(data):
+    x = 0
+    for byte in data:
+        x ^= byte
+    return x == 0
+
+
+def decode(data, address):
+    """Return ("speed", value) or ("function", value) for a packet to address, as keyed by the firmware."""
+    if data[0] == address and address < 128:
+        i = 1
+    elif 0xC0 <= data[0] <= 0xE7 and len(data) > 3 and ((data[0] & 0x3F) << 8 | data[1]) == address:
+        i = 2
+    else:
+        return None
+    instruction = data[i]
+    if instruction == 0x3F and len(data) >= i + 3:  # 128 speed steps
+        speed = data[i + 1] & 0x7F
+        return ("speed", speed | (data[i + 1] & 0x80) | 128 << 8, speed == 1)
+    if instruction & 0xC0 == 0x40:  # 28 speed steps, speed field with the intermediate step bit
+        speed = (instruction & 0x0F) << 1 | (instruction & 0x10) >> 4
+        forward = 0x80 if instruction & 0x20 else 0
+        return ("speed", speed | forward | 28 << 8, (instruction & 0x0F) == 1)
+    if instruction & 0xE0 == 0x80:  # F0-F4
+        return ("function", instruction & 0x1F, False)
+    return None
+
+
+class ConfirmHistory:
+    """confirmValue() of the firmware."""
+
+    def __init__(self, count, window):
+        self.count = count
+        self.mask = (1 << window) - 1
+        self.candidate = 0
+        self.received = 0
+
+    def confirm(self, value, current):
+        if self.count == 1 or value == current:
+            self.received = (self.received << 1) & 0xFF
+            return True
+        self.received = (self.received << 1) & 0xFF
+        if value == self.candidate:
+            self.received |= 1
+        elif self.received & self.mask == 0:
+            self.candidate = value
+            self.received = 1
+        return value == self.candidate and bin(self.received & self.mask).count("1") >= self.count
+
+
+def run(stream, count, window):
+    """Return {field: [(packet index in the field, accepted value)]} of the changes accepted."""
+    histories = {"speed": ConfirmHistory(count, window), "function": ConfirmHistory(count, window)}
+    state = dict(INITIAL_STATE)
+    index = {"speed": 0, "function": 0}
+    changes = {"speed": [], "function": []}
+    for field, value, emergency in stream:
+        # Emergency stops bypass the filter
+        if (emergency or histories[field].confirm(value, state[field])) and state[field] != value:
+            state[field] = value
+            changes[field].append((index[field], value))
+        index[field] += 1
+    return changes
+
+
+def split_glitches(changes, initial):
+    """Return the number of glitches and the real changes of a list of changes from the initial value.
+
+    A glitch is a change followed by another one within GLITCH_PACKETS packets. The change back to the
+    value before a glitch is not a real change either.
+    """
+    glitches, real = 0, []
+    value_before = initial
+    for n, (index, value) in enumerate(changes):
+        if n + 1 < len(changes) and changes[n + 1][0] - index <= GLITCH_PACKETS:
+            glitches += 1
+        elif value != value_before:
+            real.append((index, value))
+            value_before = value
+    return glitches, real
+
+
+def latency(reference, changes):
+    """Packets between each real change of the reference and the same change accepted by the filter,
+    and the number of real changes missed by the filter (not accepted before the next real change)."""
+    delays, missed = [], 0
+    for n, (index, value) in enumerate(reference):
+        end = reference[n + 1][0] if n + 1 < len(reference) else float("inf")
+        later = [i for i, v in changes if v == value and index <= i < end]
+        if later:
+            delays.append(later[0] - index)
+        else:
+            missed += 1
+    return delays, missed
+
+
+def synthesize(packets, noise, address, seed):
+    rng = random.Random(seed)
+    stream = []
+    speed, forward, functions = 0, 0x80, 0
+    for n in range(packets):
+        if n % 200 == 0:
+            speed = rng.choice([0, 20, 40, 80, 126])
+        if n % 500 == 0:
+            forward ^= 0x80
+        if n % 300 == 0:
+            functions ^= 1 << rng.randrange(5)
+        data = [address, 0x3F, forward | speed] if n % 2 == 0 else [address, 0x80 | functions]
+        x = 0
+        for byte in data:
+            x ^= byte
+        if rng.random() < noise:
+            # The same bit flipped in a data byte and in the error detection byte passes the checksum
+            bit = 1 << rng.randrange(8)
+            data[rng.randrange(1, len(data))] ^= bit
+            x ^= bit
+        stream.append(data + [x])
+    return stream
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Replay a DCC capture through the confirmation filter.")
+    parser.add_argument("capture", nargs="?", help="capture file, one packet per line in hexadecimal")
+    parser.add_argument("--address", type=int, default=3, help="address of the decoder (default 3)")
+    parser.add_argument("--interval", type=float, default=50,
+                        help="mean time between two speed (or two function) packets for the address, in ms (default 50)")
+    parser.add_argument("--synthesize", type=int, metavar="PACKETS", help="generate a stream instead of a capture")
+    parser.add_argument("--noise", type=float, default=0.01,
+                        help="probability of a corrupted packet passing the checksum (default 0.01)")
+    parser.add_argument("--seed", type=int, default=1, help="seed of the generated stream (default 1)")
+    args = parser.parse_args()
+
+    if args.synthesize:
+        packets = synthesize(args.synthesize, args.noise, args.address, args.seed)
+    elif args.capture:
+        packets = parse_capture(args.capture)
+    else:
+        sys.exit("a capture file or --synthesize is required")
+
+    stream = [d for d in (decode(p, args.address) for p in packets if checksum_ok(p)) if d]
+    if not stream:
+        sys.exit(f"no speed or F0-F4 packet for address {args.address}")
+
+    reference = run(stream, 1, 1)
+    real = {field: split_glitches(changes, INITIAL_STATE[field])[1] for field, changes in reference.items()}
+    print(f"{len(stream)} packets for address {args.address}, "
+          f"{sum(len(c) for c in real.values())} real changes")
+    print("  N  M  glitches  missed  latency mean/max (packets)  latency mean/max (ms)")
+    for window in range(1, 9):
+        for count in range(1, window + 1):
+            if count == 1 and window > 1:
+                continue
+            changes = run(stream, count, window)
+            glitches = sum(split_glitches(c, INITIAL_STATE[f])[0] for f, c in changes.items())
+            results = [latency(real[field], changes[field]) for field in changes]
+            delays = [d for field_delays, _ in results for d in field_delays]
+            missed = sum(field_missed for _, field_missed in results)
+            mean = sum(delays) / len(delays) if delays else 0
+            worst = max(delays) if delays else 0
+            print(f"  {count}  {window}  {glitches:8}  {missed:6}  {mean:13.2f} / {worst:<10}"
+                  f"  {mean * args.interval:9.0f} / {worst * args.interval:.0f}")
+
+
+if __name__ == "__main__":
+    main()
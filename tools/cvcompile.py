@@ -0,0 +1,225 @@
+#!/usr/bin/env python3
+"""Compile a human readable lighting description into DCCLight1616 configuration data.
+
+Outputs (each one optional):
+    --cvs FILE      list of CV writes ("CVnn = value"), e.g. for programming on the main track
+    --image FILE    binary EEPROM image (256 bytes) for tools/cvupload.py
+    --header FILE   header replacing FactoryDefaultCVs[] in a product build
+                    (save it as include/ProductDefaults.h and build with -D PRODUCT_DEFAULTS)
+
+The CV numbers and default values are read from FactoryDefaultCVs[] in src/main.cpp, so every CV
+known to the firmware gets a value and the description only lists what differs from the defaults.
+
+Description format (see tools/example_loco.ini):
+    [decoder]               global CVs, e.g. address = 3
+    [light0] .. [light4]    per light CVs, e.g. brightness = 200, function = F0, direction = forward
+    [cvs]                   raw CV values, e.g. CV29 = 2 or CV50Light0Brightness = 200
+Keys are the CV names of src/main.cpp without the CV number and light number, in snake case
+(control_function or function, direction_sensitivity or direction, ...).
+Only the configuration CVs (below numberOfCvsInCache of src/main.cpp) can be set: every other CV is an error.
+The CVs without a factory default (e.g. CV17 and CV18 of a long address) are added after the defaults, except in
+the list of CV writes, where CV17 and CV18 come first: programmed on the main track, the decoder must know its
+long address before CV29 switches to it.
+"""
+
+import argparse
+import configparser
+import os
+import re
+import sys
+
+IMAGE_SIZE = 256
+FCTS_EEPROM_ADDRESS = 255
+RESET_COUNTERS = range(150, 154)  # Reset counters (CV150 to CV153), started from 0
+LONG_ADDRESS_CVS = (17, 18)
+VERSION_CV = re.compile(r"CV7[A-Z]\w*")  # CV7ManufacturerVersionNumber
+
+KEY_ALIASES = {
+    "address": "PrimaryAddress",
+    "function": "ControlFunction",
+    "direction": "DirectionSensitivity",
+    "speed": "SpeedSensitivity",
+}
+
+VALUE_ALIASES = {
+    "ControlFunction": {"none": 31},
+    "DirectionSensitivity": {"both": 0, "forward": 1, "reverse": 2},
+    "SpeedSensitivity": {"always": 0, "moving": 1},
+    "Effect": {"none": 0, "strobe": 1, "rotating": 2},
+    "DayNightMode": {"disabled": 0, "model_time": 1, "binary_state": 2},
+    "PowerPriority": {"normal": 0, "protected": 1},
+    "OneShotMode": {"single": 0, "retriggerable": 1},
+    "AnalogMode": {"brightness": 0, "effect_rate": 1},
+}
+
+
+def read_firmware(path):
+    """Return the CV names ({name: number}), the ordered factory defaults [(name, value)] and the number of
+    configuration CVs (numberOfCvsInCache) of the firmware."""
+    with open(path) as f:
+        source = f.read()
+    names = {m.group(1): int(m.group(2))
+             for m in re.finditer(r"const\s+uint8_t\s+(CV\w+)\s*=\s*(\d+)\s*;", source)}
+    block = re.search(r"FactoryDefaultCVs\[\]\s*=\s*\{(.*?)\};", source, re.S)
+    if not block:
+        sys.exit(f"{path}: FactoryDefaultCVs[] not found")
+    major = re.search(r"versionIdMajor\s*=\s*(\d+)\s*;", source)
+    minor = re.search(r"versionIdMinor\s*=\s*(\d+)\s*;", source)
+    if not major or not minor:
+        sys.exit(f"{path}: versionIdMajor or versionIdMinor not found")
+    constants = {"versionId": int(major.group(1)) << 4 | int(minor.group(1))}
+    defaults = [(m.group(1), int(m.group(2)) if m.group(2).isdigit() else constants[m.group(2)])
+                for m in re.finditer(r"\{\s*(\w+)\s*,\s*(\d+|versionId)\s*\}", block.group(1))]
+    cache = re.search(r"numberOfCvsInCache\s*=\s*(\w+)\s*\+\s*1\s*;", source)
+    if not cache or cache.group(1) not in names:
+        sys.exit(f"{path}: numberOfCvsInCache not found")
+    return names, defaults, names[cache.group(1)] + 1
+
+
+def camel(key):
+    key = key.strip().lower()
+    return KEY_ALIASES.get(key) or "".join(word.capitalize() for word in key.split("_"))
+
+
+def parse_value(field, text):
+    text = text.strip().lower()
+    if text in VALUE_ALIASES.get(field, {}):
+        return VALUE_ALIASES[field][text]
+    if field == "ControlFunction" and text.startswith("f"):
+        text = text[1:]
+    value = int(text, 0)
+    if not 0 <= value <= 255:
+        raise ValueError(f"{value} out of range")
+    return value
+
+
+def find_cv(names, pattern, where):
+    matches = [name for name in names if re.fullmatch(pattern, name)]
+    if len(matches) != 1:
+        raise KeyError(f"{where}: unknown CV")
+    return matches[0]
+
+
+def compile_description(path, names, defaults, cache_size):
+    """Return the ordered list [(name, value)] of all CVs, and the extra raw CVs {number: value}."""
+    values = dict(defaults)
+    extra = {}
+    errors = []
+    numbers = {number: name for name, number in names.items()}
+    config = configparser.ConfigParser()
+    config.optionxform = str
+    if not config.read(path):
+        sys.exit(f"{path}: cannot read")
+
+    for section in config.sections():
+        for key, text in config[section].items():
+            where = f"{path} [{section}] {key}"
+            try:
+                lightMatch = re.fullmatch(r"light(\d)", section)
+                if section == "decoder" and camel(key) == "PrimaryAddress" and int(text, 0) > 127:
+                    # Long address: CV17/CV18 and bit 5 of CV29
+                    address = int(text, 0)
+                    extra[17] = 0xC0 | (address >> 8)
+                    extra[18] = address & 0xFF
+                    name = find_cv(names, r"CV\d+ModeControl", where)
+                    values[name] = values[name] | 0x20
+                    continue
+                if section == "decoder":
+                    field = camel(key)
+                    name = find_cv(names, rf"CV\d+{field}", where)
+                elif lightMatch:
+                    field = camel(key)
+                    name = find_cv(names, rf"CV\d+Light{lightMatch.group(1)}{field}", where)
+                elif section == "cvs":
+                    field = None
+                    number = int(key[2:]) if re.fullmatch(r"CV\d+", key) else names.get(key)
+                    if number is None:
+                        raise KeyError(f"{where}: unknown CV")
+                    if number not in numbers:
+                        extra[number] = parse_value(None, text)
+                        continue
+                    name = numbers[number]
+                else:
+                    raise KeyError(f"{path}: unknown section [{section}]")
+                if name in values:
+                    values[name] = parse_value(field, text)
+                else:
+                    extra[names[name]] = parse_value(field, text)  # Named CV without a factory default
+            except (KeyError, ValueError) as error:
+                errors.append(f"{where}: {error}" if isinstance(error, ValueError) else error.args[0])
+
+    # Only the configuration CVs are emitted: the firmware writes the others nowhere (factory reset, upgrade)
+    # and the EEPROM above them holds the counters, the light usage and the flight recorder
+    for number in sorted(extra):
+        if not 0 < number < cache_size:
+            errors.append(f"{path}: CV{number} is not a configuration CV (1 to {cache_size - 1})")
+    if errors:
+        sys.exit("\n".join(errors))
+    return [(name, values[name]) for name, _ in defaults], extra
+
+
+def write_cvs(path, names, cvs, extra):
+    # CV17 and CV18 before CV29, which may switch the decoder to the long address they hold
+    first = [(number, extra[number]) for number in LONG_ADDRESS_CVS if number in extra]
+    last = [(number, value) for number, value in sorted(extra.items()) if number not in LONG_ADDRESS_CVS]
+    with open(path, "w") as f:
+        for number, value in first:
+            f.write(f"CV{number} = {value}\n")
+        for name, value in cvs:
+            f.write(f"CV{names[name]} = {value}\n")
+        for number, value in last:
+            f.write(f"CV{number} = {value}\n")
+
+
+def write_image(path, names, cvs, extra):
+    image = bytearray([0xFF] * IMAGE_SIZE)
+    for name, value in cvs:
+        image[names[name]] = value
+    for number, value in extra.items():
+        image[number] = value
+    image[FCTS_EEPROM_ADDRESS] = 0  # All functions off at first power on
+    for address in RESET_COUNTERS:
+        image[address] = 0
+    with open(path, "wb") as f:
+        f.write(image)
+
+
+def write_header(path, source, cvs, extra):
+    lines = [f"// Product defaults generated by tools/cvcompile.py from {os.path.basename(source)}. Do not edit.",
+             "// Replaces FactoryDefaultCVs[] in src/main.cpp when building with -D PRODUCT_DEFAULTS",
+             "",
+             "constexpr CVPair FactoryDefaultCVs[] =",
+             "    {"]
+    # CV7 follows the firmware version the header is built with (see upgradeCVs() in src/main.cpp)
+    entries = [f"{{{name}, {'versionId' if VERSION_CV.fullmatch(name) else value}}}" for name, value in cvs]
+    entries += [f"{{{number}, {value}}}" for number, value in sorted(extra.items())]
+    lines += [f"        {entry}," for entry in entries[:-1]]
+    lines.append(f"        {entries[-1]}}};")
+    with open(path, "w") as f:
+        f.write("\n".join(lines) + "\n")
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("description", help="lighting description (.ini)")
+    parser.add_argument("--firmware", default=os.path.join(os.path.dirname(__file__), "..", "src", "main.cpp"),
+                        help="firmware source with the CV map (default: src/main.cpp)")
+    parser.add_argument("--cvs", help="output: list of CV writes")
+    parser.add_argument("--image", help="output: binary EEPROM image")
+    parser.add_argument("--header", help="output: constexpr header with FactoryDefaultCVs[]")
+    args = parser.parse_args()
+
+    names, defaults, cache_size = read_firmware(args.firmware)
+    cvs, extra = compile_description(args.description, names, defaults, cache_size)
+    if args.cvs:
+        write_cvs(args.cvs, names, cvs, extra)
+    if args.image:
+        write_image(args.image, names, cvs, extra)
+    if args.header:
+        write_header(args.header, args.description, cvs, extra)
+    if not (args.cvs or args.image or args.header):
+        write_cvs("/dev/stdout", names, cvs, extra)
+
+
+if __name__ == "__main__":
+    main()
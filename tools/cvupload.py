@@ -0,0 +1,129 @@
+#!/usr/bin/env python3
+"""Factory programming of DCCLight1616 decoders through the serial configuration port.
+
+Writes a complete 256 bytes EEPROM image (CVs stored at the location corresponding to the CV number)
+to a batch of boards and reports the throughput in CVs per second.
+See the description of the serial configuration port at the top of src/main.cpp.
+
+Usage:
+    cvupload.py image.bin PORT [PORT ...] [--count N]
+
+Each port is programmed in turn. With --count, the same port is programmed N times
+(the operator connects the next board when asked). Requires pyserial.
+"""
+
+import argparse
+import sys
+import time
+
+import serial
+
+BAUD_RATE = 115200
+IMAGE_SIZE = 256
+SYNC = b"DCL"
+SYNC_TIMEOUT = 10.0  # Time (in s) to wait for a board to power on
+SYNC_POLL = 0.01  # Time (in s) between two sync strings, well within the 100 ms window of the decoder
+READ_TIMEOUT = 1.0  # Time (in s) to wait for an answer during the session
+
+
+def crc16(data):
+    """CRC-16/CCITT-FALSE, as computed by crc16Update() in the firmware."""
+    crc = 0xFFFF
+    for byte in data:
+        crc ^= byte << 8
+        for _ in range(8):
+            crc = ((crc << 1) ^ 0x1021) if crc & 0x8000 else crc << 1
+            crc &= 0xFFFF
+    return crc
+
+
+def expect(port, value, what):
+    data = port.read(len(value))
+    if data != value:
+        raise IOError(f"{what}: expected {value!r}, received {data!r}")
+
+
+def sync(port):
+    """Send the sync string until the board powers on and answers. Returns the decoder version.
+
+    The decoder listens for the sync string during serialConfigWindow (100 ms) only, so the string is sent
+    every SYNC_POLL s. The sync strings still in flight when the decoder answers are ignored by the decoder.
+    """
+    deadline = time.monotonic() + SYNC_TIMEOUT
+    port.reset_input_buffer()
+    port.timeout = SYNC_POLL
+    try:
+        while time.monotonic() < deadline:
+            port.write(SYNC)
+            if port.read(1) == b"S":
+                port.timeout = READ_TIMEOUT
+                answer = port.read(2)
+                if len(answer) == 2:
+                    return answer[0], answer[1]
+                port.timeout = SYNC_POLL
+    finally:
+        port.timeout = READ_TIMEOUT
+    raise IOError("no answer from the decoder (power the board on while the uploader is running)")
+
+
+def program(port, image):
+    """Write and verify one board. Returns the time (in s) spent writing the image."""
+    version, pages = sync(port)
+    print(f"  decoder version {version >> 4}.{version & 0x0F}, {pages} EEPROM pages")
+
+    crc = crc16(image)
+    timeStart = time.monotonic()
+    port.write(b"W" + image + bytes((crc & 0xFF, crc >> 8)))
+    expect(port, b"." * pages + b"K", "write")
+    timeWrite = time.monotonic() - timeStart
+
+    port.write(b"R")
+    readBack = port.read(IMAGE_SIZE + 2)
+    expect(port, b"K", "read")
+    if readBack[:IMAGE_SIZE] != image or readBack[IMAGE_SIZE:] != bytes((crc & 0xFF, crc >> 8)):
+        raise IOError("verify: EEPROM content differs from the image")
+
+    port.write(b"X")
+    expect(port, b"K", "exit")
+    return timeWrite
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("image", help="binary EEPROM image (256 bytes), e.g. produced by cvcompile.py")
+    parser.add_argument("ports", nargs="+", help="serial ports of the programming jigs")
+    parser.add_argument("--count", type=int, default=1, help="number of boards to program on each port")
+    args = parser.parse_args()
+
+    with open(args.image, "rb") as f:
+        image = f.read()
+    if len(image) != IMAGE_SIZE:
+        sys.exit(f"{args.image}: image must be {IMAGE_SIZE} bytes, not {len(image)}")
+
+    boards = 0
+    failures = 0
+    timeTotal = 0.0
+    for portName in args.ports:
+        with serial.Serial(portName, BAUD_RATE, timeout=READ_TIMEOUT) as port:
+            for boardNr in range(args.count):
+                if args.count > 1:
+                    input(f"{portName}: connect board {boardNr + 1}/{args.count} and press Enter")
+                try:
+                    timeWrite = program(port, image)
+                except IOError as error:
+                    print(f"{portName}: FAILED: {error}")
+                    failures += 1
+                    continue
+                boards += 1
+                timeTotal += timeWrite
+                print(f"{portName}: OK, {IMAGE_SIZE} CVs in {timeWrite * 1000:.0f} ms "
+                      f"({IMAGE_SIZE / timeWrite:.0f} CVs/s)")
+
+    if boards:
+        print(f"{boards} boards programmed, {failures} failed, "
+              f"average {boards * IMAGE_SIZE / timeTotal:.0f} CVs/s")
+    sys.exit(1 if failures else 0)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,263 @@
+#!/usr/bin/env python3
+"""Analyze the flicker of the light outputs of DCCLight1616 for many configurations, in parallel.
+
+For each lighting description (see tools/cvcompile.py) and each combination of TCA0 prescaler (PWM frequency),
+temporal dithering and gamma, the duty traces of the lights are simulated from the light logic of the firmware
+(valueLight() with the gamma table and effect periods read from src/main.cpp). Each duty level visited is then
+turned into the light waveform of the PWM output, and analyzed with:
+    - percent flicker (modulation depth) and flicker index
+    - the IEEE 1789-2015 risk level (no observable effect, low risk, risk) at the flicker frequency
+    - the stroboscopic visibility measure SVM (CIE TN 006), from the Fourier components between 80 Hz and 2 kHz
+    - the banding seen by a camera (rolling shutter) at the given exposure times
+The slow envelope of the effects (strobe, rotating flash) is intended and not analyzed, only the PWM ripple.
+
+Temporal dithering is a candidate firmware feature: with D bits, a 16-bit gamma table gives the duty in
+1/2^D counts, and a TCA0 overflow interrupt spreads the fraction over 2^D PWM periods. It costs an interrupt
+per PWM period (--isr-cycles) and twice the flash for the table. A configuration passes when it is within the
+IEEE 1789 low risk limit, below --max-svm, and below --max-banding at every exposure. The passing
+configuration with the lowest CPU cost (then flash, then PWM frequency for the lowest switching losses, then
+SVM) is reported for each description.
+
+Usage:
+    flicker.py                                  firmware defaults
+    flicker.py loco1.ini loco2.ini --csv all.csv
+    flicker.py *.ini --led-tau 0.2 --jobs 8     LEDs with a 0.2 ms smoothing (driver capacitor, phosphor)
+"""
+
+import argparse
+import cmath
+import csv
+import itertools
+import math
+import multiprocessing
+import os
+import re
+import sys
+
+from cvcompile import compile_description, read_firmware
+
+FIRMWARE = os.path.join(os.path.dirname(os.path.abspath(__file__)), "..", "src", "main.cpp")
+NUMBER_OF_LIGHTS = 5
+PWM_COUNTS = 255  # megaTinyCore sets the period of TCA0 in split mode to 254, i.e. 255 counts
+PRESCALERS = [1, 2, 4, 8, 16, 64, 256, 1024]
+SAMPLES_PER_PERIOD = 64
+SVM_EXPONENT = 3.7
+
+
+def read_light_logic(path):
+    """Return the gamma table and the effect periods (in ms) of the firmware."""
+    with open(path) as f:
+        source = f.read()
+    table = re.search(r"const uint8_t gamma\[\]\s*=\s*\{(.*?)\};", source, re.S)
+    if not table:
+        sys.exit(f"{path}: gamma[] not found")
+    periods = {name: int(value) for name, value in
+               re.findall(r"const uint32_t (\w+FlashPeriod) = (\d+);", source)}
+    return [int(v) for v in re.findall(r"\d+", table.group(1))], periods
+
+
+def light_levels(cvs, gamma_table, periods, frame):
+    """Return, for each light, the 8-bit brightness levels (before gamma) visited by its effect."""
+    by_name = dict(cvs)
+    levels = []
+    for n in range(NUMBER_OF_LIGHTS):
+        def cv(field):
+            return next(v for name, v in by_name.items() if re.fullmatch(rf"CV\d+Light{n}{field}", name))
+        visited = set()
+        for brightness in {cv("Brightness"), cv("NightBrightness")}:
+            effect = cv("Effect")
+            if effect == 1:
+                visited.update({brightness, 0})
+            elif effect == 2:
+                period = periods["rotatingFlashPeriod"]
+                for t in range(0, period, frame):
+                    if t < period // 2:
+                        visited.add(2 * brightness * t // period)
+                    else:
+                        visited.add(2 * brightness * (period - t) // period)
+            else:
+                visited.add(brightness)
+        levels.append(sorted(visited))
+    return levels
+
+
+def gamma_duties(gamma, dither, gamma_table):
+    """Duty (in 1/2^dither counts) for each 8-bit brightness."""
+    scale = PWM_COUNTS << dither
+    if gamma == "firmware" and dither == 0:
+        return gamma_table
+    if gamma == "firmware":
+        # Exponent fitted to the firmware table, for the finer dithered table
+        fits = [math.log(gamma_table[i] / 255) / math.log(i / 255) for i in range(64, 255) if gamma_table[i]]
+        exponent = sorted(fits)[len(fits) // 2]
+    else:
+        exponent = float(gamma)
+    return [round(scale * (i / 255) ** exponent) for i in range(256)]
+
+
+def pulse_widths(duty, dither):
+    """High counts of each PWM period of a dithering cycle."""
+    cycle = 1 << dither
+    base, extra = duty >> dither, duty & (cycle - 1)
+    return [min(PWM_COUNTS, base + (1 if (j * extra) % cycle < extra else 0)) for j in range(cycle)]
+
+
+def waveform(widths, period, tau):
+    """Light output over one dithering cycle in steady state, sampled SAMPLES_PER_PERIOD times per PWM period."""
+    step = period / SAMPLES_PER_PERIOD
+    raw = [1.0 if s * PWM_COUNTS < w * SAMPLES_PER_PERIOD else 0.0
+           for w in widths for s in range(SAMPLES_PER_PERIOD)]
+    if tau <= 0:
+        return raw
+    alpha = 1 - math.exp(-step / tau)
+    cycles = 2 + int(5 * tau / (period * len(widths)))
+    y = sum(raw) / len(raw)
+    for _ in range(cycles):
+        out = []
+        for x in raw:
+            y += (x - y) * alpha
+            out.append(y)
+    return out
+
+
+def fourier(widths, period, tau, f_max):
+    """Relative amplitudes (to the mean) of the Fourier components of the light, up to f_max: [(f, C)].
+
+    period and tau are in s, frequencies in Hz.
+    """
+    cycle_time = period * len(widths)
+    mean = sum(widths) / (PWM_COUNTS * len(widths))
+    components = []
+    m = 1
+    while m / cycle_time <= f_max:
+        c = 0
+        for j, w in enumerate(widths):
+            start = j * period
+            end = start + w / PWM_COUNTS * period
+            c += (cmath.exp(-2j * math.pi * m * start / cycle_time) - cmath.exp(-2j * math.pi * m * end / cycle_time))
+        c /= 2j * math.pi * m
+        f = m / cycle_time
+        c /= complex(1, 2 * math.pi * f * tau)
+        components.append((f, 2 * abs(c) / mean))
+        m += 1
+    return components
+
+
+def svm_threshold(f):
+    return 1 / (1 + math.exp(-0.00518 * (f - 306.6))) + 20 * math.exp(-f / 10)
+
+
+def ieee1789_level(percent, frequency):
+    """0: no observable effect, 1: low risk, 2: risk."""
+    if frequency < 90:
+        no_effect, low_risk = 0.01 * frequency, 0.025 * frequency
+    else:
+        no_effect = 0.0333 * frequency if frequency <= 3000 else float("inf")
+        low_risk = 0.08 * frequency if frequency <= 1250 else float("inf")
+    return 0 if percent <= no_effect else 1 if percent <= low_risk else 2
+
+
+def analyze_duty(duty, dither, period, tau, exposures):
+    """Metrics of one duty level: percent flicker, flicker index, IEEE 1789 level, SVM, camera banding."""
+    widths = pulse_widths(duty, dither)
+    if sum(widths) == 0 or all(w == PWM_COUNTS for w in widths):
+        return 0.0, 0.0, 0, 0.0, [0.0] * len(exposures)
+    light = waveform(widths, period, tau)
+    high, low, mean = max(light), min(light), sum(light) / len(light)
+    percent = 100 * (high - low) / (high + low)
+    index = sum(v - mean for v in light if v > mean) / sum(light)
+
+    components = fourier(widths, period / 1000, tau / 1000, max(2000, 1000 / period))
+    strongest = max(c for _, c in components)
+    frequency = next(f for f, c in components if c >= 0.1 * strongest)
+    svm = sum((c / svm_threshold(f)) ** SVM_EXPONENT for f, c in components if 80 <= f <= 2000) ** (1 / SVM_EXPONENT)
+
+    # Camera: light integrated over the exposure time, for every start time of the exposure
+    banding = []
+    step = period / SAMPLES_PER_PERIOD
+    total = sum(light)
+    prefix = list(itertools.accumulate(light + light, initial=0))
+    for exposure in exposures:
+        samples = max(1, round(exposure / step))
+        cycles, rest = divmod(samples, len(light))
+        sums = [cycles * total + prefix[s + rest] - prefix[s] for s in range(len(light))]
+        banding.append(100 * (max(sums) - min(sums)) / (max(sums) + min(sums)))
+    return percent, index, ieee1789_level(percent, frequency), svm, banding
+
+
+def analyze(task):
+    """Worst metrics over the lights and duty levels of one configuration."""
+    label, levels, prescaler, dither, gamma, args, gamma_table = task
+    period = prescaler * PWM_COUNTS / args.f_cpu * 1000  # ms
+    duties = gamma_duties(gamma, dither, gamma_table)
+    worst = [0.0, 0.0, 0, 0.0, [0.0] * len(args.exposures)]
+    for duty in sorted({duties[b] for light in levels for b in light}):
+        metrics = analyze_duty(duty, dither, period, args.led_tau, args.exposures)
+        for i in range(4):
+            worst[i] = max(worst[i], metrics[i])
+        worst[4] = [max(a, b) for a, b in zip(worst[4], metrics[4])]
+    frequency = 1000 / period
+    cpu = 100 * frequency * args.isr_cycles / args.f_cpu if dither else 0.0
+    flash = 256 if dither == 0 else 512
+    passed = worst[2] <= 1 and worst[3] <= args.max_svm and all(b <= args.max_banding for b in worst[4])
+    return {"description": label, "prescaler": prescaler, "pwm_hz": round(frequency, 1), "dither_bits": dither,
+            "gamma": gamma, "percent_flicker": round(worst[0], 1), "flicker_index": round(worst[1], 3),
+            "ieee1789": ("no effect", "low risk", "risk")[worst[2]], "svm": round(worst[3], 3),
+            **{f"banding_{e:g}ms": round(b, 1) for e, b in zip(args.exposures, worst[4])},
+            "cpu_percent": round(cpu, 2), "flash_bytes": flash, "pass": passed}
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Flicker analysis of the light outputs over many configurations.")
+    parser.add_argument("descriptions", nargs="*", help="lighting descriptions (.ini), default: firmware defaults")
+    parser.add_argument("--firmware", default=FIRMWARE, help="firmware source (default: src/main.cpp)")
+    parser.add_argument("--f-cpu", type=float, default=20e6, help="CPU clock in Hz (default 20e6)")
+    parser.add_argument("--prescalers", default=",".join(map(str, PRESCALERS)), help="TCA0 prescalers to try")
+    parser.add_argument("--dither", default="0,1,2", help="dithering bits to try (default 0,1,2)")
+    parser.add_argument("--gamma", default="firmware,2.2,2.8", help="gamma to try: firmware or an exponent")
+    parser.add_argument("--led-tau", type=float, default=0, help="smoothing time constant of the light, in ms")
+    parser.add_argument("--exposures", default="1,4", help="camera exposure times in ms (default 1,4)")
+    parser.add_argument("--frame", type=int, default=1, help="interval between duty updates, in ms (default 1)")
+    parser.add_argument("--isr-cycles", type=int, default=90, help="CPU cycles of a dithering interrupt (default 90)")
+    parser.add_argument("--max-svm", type=float, default=1.0, help="maximum SVM to pass (default 1.0)")
+    parser.add_argument("--max-banding", type=float, default=10, help="maximum camera banding in percent (default 10)")
+    parser.add_argument("--jobs", type=int, default=os.cpu_count(), help="parallel jobs (default: all cores)")
+    parser.add_argument("--csv", help="write the metrics of every configuration to this file")
+    args = parser.parse_args()
+    args.exposures = [float(e) for e in args.exposures.split(",")]
+
+    gamma_table, periods = read_light_logic(args.firmware)
+    names, defaults = read_firmware(args.firmware)
+    descriptions = [(os.path.basename(p), compile_description(p, names, defaults)[0]) for p in args.descriptions]
+    if not descriptions:
+        descriptions = [("defaults", defaults)]
+
+    tasks = [(label, light_levels(cvs, gamma_table, periods, args.frame), int(prescaler), int(dither), gamma,
+              args, gamma_table)
+             for label, cvs in descriptions
+             for prescaler in args.prescalers.split(",")
+             for dither in args.dither.split(",")
+             for gamma in args.gamma.split(",")]
+    with multiprocessing.Pool(args.jobs) as pool:
+        results = pool.map(analyze, tasks)
+
+    if args.csv:
+        with open(args.csv, "w", newline="") as f:
+            writer = csv.DictWriter(f, fieldnames=list(results[0]))
+            writer.writeheader()
+            writer.writerows(results)
+
+    for label, _ in descriptions:
+        passing = sorted((r for r in results if r["description"] == label and r["pass"]),
+                         key=lambda r: (r["cpu_percent"], r["flash_bytes"], r["pwm_hz"], r["svm"]))
+        if not passing:
+            print(f"{label}: no configuration passes")
+            continue
+        best = passing[0]
+        print(f"{label}: prescaler {best['prescaler']} ({best['pwm_hz']} Hz), {best['dither_bits']} dithering bits, "
+              f"gamma {best['gamma']}: IEEE 1789 {best['ieee1789']}, SVM {best['svm']}, "
+              f"banding {max(v for k, v in best.items() if k.startswith('banding'))}%, CPU {best['cpu_percent']}%")
+
+
+if __name__ == "__main__":
+    main()
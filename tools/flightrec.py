@@ -0,0 +1,90 @@
+#!/usr/bin/env python3
+"""Read and decode the flight recorder of a DCCLight1616 decoder through the serial configuration port.
+
+The events before the last watchdog, brown-out or software reset are saved to the EEPROM at the next boot.
+See the description of the flight recorder at the top of src/main.cpp.
+
+Usage:
+    flightrec.py PORT           read the decoder (power it on while the tool is running)
+    flightrec.py --image FILE   decode an EEPROM image read before
+"""
+
+import argparse
+import sys
+
+import serial
+
+from cvupload import BAUD_RATE, IMAGE_SIZE, crc16, expect, sync
+
+FLIGHT_RECORDER_ADDRESS = 208
+FLIGHT_RECORDER_SIZE = 11
+
+RESET_FLAGS = {0x01: "power on", 0x02: "brown-out", 0x04: "external", 0x08: "watchdog", 0x10: "software", 0x20: "UPDI"}
+
+# FlightRecorderEvent in src/main.cpp
+EVENTS = {
+    1: ("boot", lambda d: "reset flags " + describe_reset(d)),
+    2: ("speed", lambda d: f"{d & 0x7F} {'fwd' if d & 0x80 else 'rev'}"),
+    3: ("emergency stop", lambda d: ""),
+    4: ("function", lambda d: f"F0-F4 state 0b{d:08b}"),
+    5: ("binary state", lambda d: f"#{d}"),
+    6: ("CV change", lambda d: f"CV{d}"),
+    7: ("CV ack", lambda d: ""),
+    8: ("factory reset", lambda d: ""),
+    9: ("EEPROM write", lambda d: f"address {d}"),
+    10: ("drive cutoff", lambda d: f"Light{d}"),
+}
+
+
+def describe_reset(flags):
+    return ", ".join(name for bit, name in RESET_FLAGS.items() if flags & bit) or "none"
+
+
+def read_image(portName):
+    with serial.Serial(portName, BAUD_RATE, timeout=1.0) as port:
+        sync(port)
+        port.write(b"R")
+        data = port.read(IMAGE_SIZE + 2)
+        expect(port, b"K", "read")
+        port.write(b"X")
+        expect(port, b"K", "exit")
+    image = data[:IMAGE_SIZE]
+    if len(data) != IMAGE_SIZE + 2 or crc16(image) != data[IMAGE_SIZE] | data[IMAGE_SIZE + 1] << 8:
+        raise IOError("read: CRC error")
+    return image
+
+
+def decode(image):
+    flags, count = image[FLIGHT_RECORDER_ADDRESS], image[FLIGHT_RECORDER_ADDRESS + 1]
+    if flags == 0xFF or count > FLIGHT_RECORDER_SIZE:
+        print("Flight recorder empty")
+        return
+    print(f"Reset cause: {describe_reset(flags)}, {count} events")
+    for i in range(count):
+        entry = image[FLIGHT_RECORDER_ADDRESS + 2 + 4 * i:FLIGHT_RECORDER_ADDRESS + 6 + 4 * i]
+        time = (entry[0] | entry[1] << 8) * 16
+        name, describe = EVENTS.get(entry[2], (f"event {entry[2]}", lambda d: f"data {d}"))
+        print(f"  {time / 1000:9.3f} s  {name:15} {describe(entry[3])}")
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("port", nargs="?", help="serial port of the programming jig")
+    parser.add_argument("--image", help="EEPROM image file to decode instead of reading a decoder")
+    args = parser.parse_args()
+
+    if args.image:
+        with open(args.image, "rb") as f:
+            image = f.read()
+    elif args.port:
+        try:
+            image = read_image(args.port)
+        except IOError as error:
+            sys.exit(f"{args.port}: {error}")
+    else:
+        parser.error("a port or --image is required")
+    decode(image)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,102 @@
+#!/usr/bin/env python3
+"""List how the firmware of DCCLight1616 reaches the hot flags kept in GPIOR1 to GPIOR3.
+
+The light and loco flags live in the general purpose I/O registers so that avr-gcc can test them with sbis/sbic
+and set or clear them with sbi/cbi, in one instruction each (see the hot flags in src/main.cpp). It does so only
+when the register and the bit are constants: an access through a runtime index or mask compiles to in/out around
+a shift loop, or to a load/store through a pointer, which this tool cannot attribute to a GPIOR. The tool
+disassembles a build with avr-objdump and counts, per function, the instructions naming GPIOR1 to GPIOR3:
+
+    sbis/sbic   single cycle bit tests (2 or 3 cycles when skipping)
+    sbi/cbi     single instruction bit writes (1 cycle on the AVRxt core)
+    in/out      whole register reads and writes (1 cycle)
+    lds/sts     data space accesses (2 or 3 cycles, 2 words): none expected
+
+Run it on the builds before and after a change of the flag accesses to compare the listings.
+
+Usage:
+    gpiorcheck.py                                   check .pio/build/ATtiny1616/firmware.elf
+    gpiorcheck.py firmware.elf --function valueLight   list the GPIOR instructions of matching functions
+"""
+
+import argparse
+import re
+import subprocess
+import sys
+
+GPIOR = {0x1D: "GPIOR1", 0x1E: "GPIOR2", 0x1F: "GPIOR3"}  # I/O addresses (data space = I/O address)
+IO_INSTRUCTIONS = ("sbis", "sbic", "sbi", "cbi", "in", "out")
+DATA_INSTRUCTIONS = ("lds", "sts")
+COLUMNS = IO_INSTRUCTIONS + DATA_INSTRUCTIONS
+
+FUNCTION = re.compile(r"^[0-9a-f]+ <(.+)>:$")
+INSTRUCTION = re.compile(r"^\s*[0-9a-f]+:\s+(?:[0-9a-f]{2} )+\s*(\w+)\s+([^;]*)")
+
+
+def gpior_operand(mnemonic, operands):
+    """Return the GPIOR named by the operands of the instruction, or None."""
+    parts = [p.strip() for p in operands.split(",")]
+    if mnemonic in ("sbis", "sbic", "sbi", "cbi", "out"):
+        address = parts[0]
+    elif mnemonic in ("in", "lds"):
+        address = parts[1] if len(parts) > 1 else ""
+    elif mnemonic == "sts":
+        address = parts[0]
+    else:
+        return None
+    try:
+        return GPIOR.get(int(address, 0))
+    except ValueError:
+        return None
+
+
+def scan(listing):
+    """Return {function: {mnemonic: count}} and {function: [lines]} for the instructions naming a GPIOR."""
+    counts, lines = {}, {}
+    function = None
+    for line in listing.splitlines():
+        match = FUNCTION.match(line)
+        if match:
+            function = match.group(1)
+            continue
+        match = INSTRUCTION.match(line)
+        if not match or function is None:
+            continue
+        mnemonic, operands = match.group(1), match.group(2)
+        if mnemonic in COLUMNS and gpior_operand(mnemonic, operands):
+            counts.setdefault(function, dict.fromkeys(COLUMNS, 0))[mnemonic] += 1
+            lines.setdefault(function, []).append(line.strip())
+    return counts, lines
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Count the instructions reaching GPIOR1 to GPIOR3 in a build.")
+    parser.add_argument("elf", nargs="?", default=".pio/build/ATtiny1616/firmware.elf", help="firmware ELF file")
+    parser.add_argument("--objdump", default="avr-objdump", help="disassembler (default avr-objdump)")
+    parser.add_argument("--function", help="list the GPIOR instructions of the functions containing this name")
+    args = parser.parse_args()
+
+    try:
+        listing = subprocess.run([args.objdump, "-d", "-C", args.elf], check=True, capture_output=True,
+                                 text=True).stdout
+    except (OSError, subprocess.CalledProcessError) as error:
+        sys.exit(f"cannot disassemble {args.elf}: {error}")
+
+    counts, lines = scan(listing)
+    if args.function:
+        for function in sorted(f for f in lines if args.function in f):
+            print(function)
+            for line in lines[function]:
+                print("    " + line)
+        return
+
+    print(f"{'function':40}" + "".join(f"{c:>6}" for c in COLUMNS))
+    for function in sorted(counts):
+        print(f"{function[:40]:40}" + "".join(f"{counts[function][c]:6}" for c in COLUMNS))
+    data = sum(counts[f][c] for f in counts for c in DATA_INSTRUCTIONS)
+    if data:
+        sys.exit(f"{data} lds/sts to a GPIOR: an access uses a runtime register or bit")
+
+
+if __name__ == "__main__":
+    main()
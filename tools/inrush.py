@@ -0,0 +1,115 @@
+#!/usr/bin/env python3
+"""Simulate the aggregate current drawn by a fleet of DCCLight1616 decoders when the layout is powered on.
+
+Every decoder restores its lights at power on. Without the power up stagger (CV44, CV45) they all do it at the
+same instant and the booster sees the sum of all lights at once. This tool reproduces the power up delay and
+ramp of the firmware (initPowerUp() and updatePowerUp() in src/main.cpp) for a fleet of decoders with random
+serial numbers, and reports the peak current and the steepest current step with and without the stagger.
+The current step matters even with LEDs, whose peak is the steady state: a booster sees the whole fleet
+switching on within one ms as a short circuit.
+
+Incandescent bulbs draw several times their nominal current while their filament is cold. With --bulb, each
+light is modelled as a filament whose extra current decays as it heats, faster at a higher duty.
+
+Usage:
+    inrush.py                               40 decoders, 3 lights of 20 mA, CV44 = 10, CV45 = 5
+    inrush.py --decoders 100 --bulb         100 decoders with incandescent bulbs
+    inrush.py --stagger 20 --ramp 10 --csv inrush.csv
+"""
+
+import argparse
+import random
+import sys
+
+
+def power_up_delay(address, serial_number, stagger):
+    """Power up delay (in ms) of a decoder, as computed by initPowerUp()."""
+    h = address & 0xFFFF
+    for byte in serial_number:
+        h = (h * 31 + byte) & 0xFFFF
+    h ^= (h << 7) & 0xFFFF
+    h ^= h >> 9
+    h ^= (h << 8) & 0xFFFF
+    return (h * stagger * 100) >> 16
+
+
+def power_up_scale(elapsed, delay, ramp):
+    """Duty scale (in 1/256) of a decoder at elapsed ms after power on, as computed by updatePowerUp()."""
+    if delay == 0 and ramp == 0:
+        return 256
+    if elapsed < delay:
+        return 0
+    if elapsed - delay < ramp:
+        return ((elapsed - delay) << 8) // ramp
+    return 256
+
+
+def simulate(decoders, args, stagger, ramp):
+    """Return the aggregate current (in mA) for each ms after power on."""
+    ramp_ms = ramp * 100
+    delays = [power_up_delay(address, serial_number, stagger) for address, serial_number in decoders]
+    duration = max(delays) + ramp_ms + args.tail
+    cold = [1.0] * len(decoders)  # Cold filament fraction of the bulbs of each decoder (1 = cold, 0 = hot)
+    currents = []
+    for t in range(duration):
+        total = len(decoders) * args.idle
+        for n, delay in enumerate(delays):
+            duty = power_up_scale(t, delay, ramp_ms) / 256
+            current = args.lights * args.current * duty
+            if args.bulb:
+                current *= 1 + (args.bulb_factor - 1) * cold[n]
+                cold[n] -= cold[n] * duty * duty / args.bulb_tau
+            total += current
+        currents.append(total)
+    return currents, max(delays) + ramp_ms
+
+
+def max_step(currents):
+    """Steepest increase of the current (in mA) over one ms, including the step at power on."""
+    return max(b - a for a, b in zip([0] + currents, currents))
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Simulate the power up inrush current of a fleet of decoders.")
+    parser.add_argument("--decoders", type=int, default=40, help="number of decoders (default 40)")
+    parser.add_argument("--lights", type=int, default=3, help="lights on per decoder (default 3)")
+    parser.add_argument("--current", type=float, default=20, help="current of a light at full duty, in mA (default 20)")
+    parser.add_argument("--idle", type=float, default=5, help="current of a decoder without lights, in mA (default 5)")
+    parser.add_argument("--stagger", type=int, default=10, help="CV44 power up stagger, in 0.1 s (default 10)")
+    parser.add_argument("--ramp", type=int, default=5, help="CV45 power up ramp, in 0.1 s (default 5)")
+    parser.add_argument("--bulb", action="store_true", help="model incandescent bulbs instead of LEDs")
+    parser.add_argument("--bulb-factor", type=float, default=10, help="cold to hot current ratio of a bulb (default 10)")
+    parser.add_argument("--bulb-tau", type=float, default=30, help="heating time constant of a bulb, in ms (default 30)")
+    parser.add_argument("--tail", type=int, default=100, help="ms simulated after the last decoder is restored (default 100)")
+    parser.add_argument("--seed", type=int, default=1, help="seed of the random serial numbers (default 1)")
+    parser.add_argument("--csv", help="write the current of both runs for each ms to this file")
+    args = parser.parse_args()
+
+    if args.decoders < 1 or not 0 <= args.stagger <= 255 or not 0 <= args.ramp <= 255:
+        sys.exit("invalid fleet or CV values")
+
+    rng = random.Random(args.seed)
+    decoders = [(3 + n, bytes(rng.randrange(256) for _ in range(10))) for n in range(args.decoders)]
+
+    instant, _ = simulate(decoders, args, 0, 0)
+    staggered, bound = simulate(decoders, args, args.stagger, args.ramp)
+    steady = args.decoders * (args.idle + args.lights * args.current)
+
+    print(f"{args.decoders} decoders, {args.lights} {'bulbs' if args.bulb else 'LEDs'} of {args.current:g} mA, "
+          f"steady state {steady / 1000:.2f} A")
+    print(f"No stagger:               peak {max(instant) / 1000:.2f} A, step {max_step(instant) / 1000:.2f} A/ms")
+    print(f"CV44 = {args.stagger:3}, CV45 = {args.ramp:3}:   peak {max(staggered) / 1000:.2f} A, "
+          f"step {max_step(staggered) / 1000:.2f} A/ms, "
+          f"all lights restored after {bound} ms (bound {(args.stagger + args.ramp) * 100} ms)")
+
+    if args.csv:
+        with open(args.csv, "w") as f:
+            f.write("ms,no_stagger_mA,staggered_mA\n")
+            for t in range(max(len(instant), len(staggered))):
+                a = instant[t] if t < len(instant) else instant[-1]
+                b = staggered[t] if t < len(staggered) else staggered[-1]
+                f.write(f"{t},{a:.1f},{b:.1f}\n")
+
+
+if __name__ == "__main__":
+    main()
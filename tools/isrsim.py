@@ -0,0 +1,152 @@
+#!/usr/bin/env python3
+"""Model the DCC bit decode errors of DCCLight1616 caused by interrupt latency, with the DCC input at level 0 or 1.
+
+NmraDcc times the half bits of the DCC signal with micros() read in the ISR of the DCC input, so the time it reads
+for an edge is late by the latency of this ISR. When the DCC input shares level 0 with the millis() (TCD0) and UART
+interrupts, an edge arriving during one of their ISRs waits for its end. At level 1 (CPUINT.LVL1VEC) the DCC ISR
+would preempt them and only wait for the sections run with interrupts disabled.
+
+The firmware keeps the DCC input at level 0: NmraDcc reads the edge time with micros(), which returns a torn time
+when its ISR preempts the millis() ISR in the middle of its update. The model does not cover that hazard. Its
+level 1 column is the gain hardware timestamps of the edges (TCB input capture) would bring, not an option of the
+current firmware.
+
+The tool generates a stream of DCC bits (one half bit of 58 us, zero half bit of 100 us) and a load of level 0
+ISRs: the millis() tick every ms, one UART interrupt per byte at the given byte rate, and an extra periodic ISR
+standing for effect processing. A half bit is decoded wrong when its measured length falls on the other side of
+the NmraDcc limit (82 us), or when the two halves of a one bit differ by more than 24 us. A packet is lost when
+one of its bits is wrong.
+
+This is a model, not a measurement: the times of the ISRs are estimates to be replaced by the histograms of the
+firmware built with ISR_PROFILE (CV174 to CV197).
+
+Usage:
+    isrsim.py                                   default load, 10 s of DCC signal
+    isrsim.py --uart-rate 11520 --effect-isr 40 heavy UART and effect load
+"""
+
+import argparse
+import random
+import sys
+
+ONE_HALF = 58         # us
+ZERO_HALF = 100       # us
+MAX_ONE_HALF = 82     # us, longer half bits are zeros (NmraDcc)
+MAX_BIT_DIFF = 24     # us, maximum difference between the two halves of a one bit (NmraDcc)
+PACKET_BITS = 14 + 3 * 9 + 1  # Preamble, address, instruction and error detection bytes with their start bits, end bit
+
+
+def dcc_edges(duration, rng):
+    """Return the times (in us) of the edges and the value of the bit each half bit belongs to."""
+    edges, bits = [0.0], []
+    t = 0.0
+    while t < duration:
+        bit = rng.random() < 0.6  # Preambles make the ones more frequent
+        half = ONE_HALF if bit else ZERO_HALF
+        for _ in range(2):
+            t += half
+            edges.append(t)
+            bits.append(bit)
+    return edges, bits
+
+
+def blocking_intervals(duration, args, rng, level1):
+    """Return the sorted (start, end) intervals (in us) during which the DCC ISR cannot start."""
+    intervals = []
+    if not level1:
+        t = rng.uniform(0, 1000)
+        while t < duration:
+            intervals.append((t, t + args.millis_isr))
+            t += 1000
+        if args.uart_rate:
+            t = rng.expovariate(args.uart_rate / 1e6)
+            while t < duration:
+                intervals.append((t, t + args.uart_isr))
+                t += rng.expovariate(args.uart_rate / 1e6)
+        if args.effect_isr:
+            t = rng.uniform(0, args.effect_period)
+            while t < duration:
+                intervals.append((t, t + args.effect_isr))
+                t += args.effect_period
+    # Sections run with interrupts disabled (micros(), millis(), EEPROM) block both levels
+    t = rng.uniform(0, args.cli_period)
+    while t < duration:
+        intervals.append((t, t + args.cli))
+        t += rng.uniform(0.5, 1.5) * args.cli_period
+    intervals.sort()
+    return intervals
+
+
+def latencies(edges, intervals, entry):
+    """Latency (in us) of the DCC ISR for each edge: wait for the end of the blocking intervals, then enter."""
+    result = []
+    i = 0
+    for edge in edges:
+        while i < len(intervals) and intervals[i][1] <= edge:
+            i += 1
+        start = edge
+        j = i
+        while j < len(intervals) and intervals[j][0] <= start:
+            start = max(start, intervals[j][1])
+            j += 1
+        result.append(start - edge + entry)
+    return result
+
+
+def decode_errors(edges, bits, late):
+    """Return the number of half bits decoded wrong and the indexes of the half bits in error."""
+    errors = []
+    for n, bit in enumerate(bits):
+        measured = (edges[n + 1] + late[n + 1]) - (edges[n] + late[n])
+        wrong = (measured < MAX_ONE_HALF) != bit
+        if bit and n % 2 == 1:
+            previous = (edges[n] + late[n]) - (edges[n - 1] + late[n - 1])
+            wrong = wrong or abs(measured - previous) > MAX_BIT_DIFF
+        if wrong:
+            errors.append(n)
+    return errors
+
+
+def packets_lost(errors, half_bits):
+    bad = {n // (2 * PACKET_BITS) for n in errors}
+    return len(bad), half_bits // (2 * PACKET_BITS)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Model the DCC bit decode errors caused by interrupt latency.")
+    parser.add_argument("--seconds", type=float, default=10, help="duration of the DCC signal (default 10)")
+    parser.add_argument("--millis-isr", type=float, default=8, help="duration of the millis() ISR, in us (default 8)")
+    parser.add_argument("--uart-rate", type=float, default=0, help="UART interrupts per s (default 0)")
+    parser.add_argument("--uart-isr", type=float, default=6, help="duration of a UART ISR, in us (default 6)")
+    parser.add_argument("--effect-isr", type=float, default=0,
+                        help="duration of an extra level 0 ISR, in us (default 0 = none)")
+    parser.add_argument("--effect-period", type=float, default=500,
+                        help="period of the extra ISR, in us (default 500)")
+    parser.add_argument("--cli", type=float, default=1.5, help="duration of a section with interrupts disabled, "
+                        "in us (default 1.5)")
+    parser.add_argument("--cli-period", type=float, default=200,
+                        help="mean time between two sections with interrupts disabled, in us (default 200)")
+    parser.add_argument("--entry", type=float, default=1, help="ISR entry time, in us (default 1)")
+    parser.add_argument("--seed", type=int, default=1, help="seed of the random stream and load (default 1)")
+    args = parser.parse_args()
+
+    if args.seconds <= 0 or args.effect_period <= 0 or args.cli_period <= 0:
+        sys.exit("invalid duration or period")
+
+    duration = args.seconds * 1e6
+    print(f"{args.seconds:g} s of DCC signal, millis() ISR {args.millis_isr:g} us, "
+          f"UART {args.uart_rate:g}/s x {args.uart_isr:g} us, "
+          f"extra ISR {args.effect_isr:g} us every {args.effect_period:g} us")
+    print("  DCC input  latency mean/max (us)  half bits in error     packets lost")
+    for level1 in (False, True):
+        rng = random.Random(args.seed)
+        edges, bits = dcc_edges(duration, rng)
+        late = latencies(edges, blocking_intervals(duration, args, rng, level1), args.entry)
+        errors = decode_errors(edges, bits, late)
+        lost, packets = packets_lost(errors, len(bits))
+        print(f"  level {int(level1)}    {sum(late) / len(late):9.2f} / {max(late):<10.1f}"
+              f"  {len(errors):8} ({len(errors) / len(bits):.1e})  {lost:6} / {packets}")
+
+
+if __name__ == "__main__":
+    main()